@@ -0,0 +1,211 @@
+#ifndef APNG_HPP
+#define APNG_HPP
+
+#include <movie.hpp>
+#include <pixel.hpp>
+#include <pngz.hpp>
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <png.h>
+#include <zlib.h>
+
+namespace im {
+
+   // Animated PNG movie sink. The first frame is stored whole; every later
+   // frame is stored as the bounding box of the pixels that changed since the
+   // frame before it, drawn over the previous frame, so a frame costs in
+   // proportion to the area that changed. Frames are lossless, so the movie's
+   // quality is taken as the deflate level, 0 to 9.
+   struct apng_sink {
+
+      png_zwriter _out;
+      unsigned _width, _height, _fps;
+      int _level;
+      long _actl = 0;
+      uint32_t _frames = 0;
+      uint32_t _sequence = 0;
+      std::vector<pixel> _prev;
+
+      apng_sink(const std::string &filename, unsigned w, unsigned h, unsigned fps, unsigned level) :
+         _width(w), _height(h), _fps(fps), _level(level < 9 ? level : 9), _prev(size_t(w)*h) {
+         if (_out.open(filename.c_str(), w, h, 8, PNG_COLOR_TYPE_RGB, _level))
+            return;
+         _actl = ftell(_out.f);
+         write_actl();
+      }
+
+      // The frame count is not known until the end, so acTL is written as a
+      // placeholder and patched on close.
+      inline void write_actl() {
+         png_byte actl[8];
+         png_zwriter::put32(actl, _frames);
+         png_zwriter::put32(actl + 4, 0);
+         _out.write_chunk("acTL", NULL, 0, actl, 8);
+      }
+
+      static inline bool same(const pixel* a, const pixel* b, size_t n) {
+         return std::memcmp(a, b, n*sizeof(pixel)) == 0;
+      }
+
+      // Bounding box [x0, x1) x [y0, y1) of the pixels of f within r that
+      // differ from the previous frame; false if there are none.
+      template<typename F>
+      bool dirty(F &f, const region &r, unsigned &x0, unsigned &y0, unsigned &x1, unsigned &y1) {
+         if (r.empty())
+            return false;
+         const size_t w = _width;
+         const size_t n = r.x1 - r.x0;
+         y0 = r.y0;
+         while (y0 < r.y1 and same(f.row(y0) + r.x0, &_prev[y0*w + r.x0], n))
+            y0++;
+         if (y0 == r.y1)
+            return false;
+         y1 = r.y1;
+         while (same(f.row(y1-1) + r.x0, &_prev[(y1-1)*w + r.x0], n))
+            y1--;
+
+         x0 = r.x1;
+         x1 = r.x0;
+         for (unsigned y = y0; y < y1; y++) {
+            const pixel* p = f.row(y);
+            const pixel* q = &_prev[y*w];
+            unsigned a = r.x0;
+            while (a < x0 and same(p + a, q + a, 1))
+               a++;
+            x0 = a;
+            unsigned b = r.x1;
+            while (b > x1 and same(p + b-1, q + b-1, 1))
+               b--;
+            x1 = b;
+         }
+         return true;
+      }
+
+      // Image data goes in IDAT for the first frame and in sequence numbered
+      // fdAT chunks after it.
+      inline void write_data(bool header, const png_byte* data, size_t n) {
+         png_byte pre[6];
+         size_t npre = 0;
+         if (_frames) {
+            png_zwriter::put32(pre, _sequence++);
+            npre = 4;
+         }
+         if (header) {
+            pre[npre++] = _out.zheader[0];
+            pre[npre++] = _out.zheader[1];
+         }
+         _out.write_chunk(_frames ? "fdAT" : "IDAT", pre, npre, data, n);
+      }
+
+      template<typename F>
+      void write_region(F &f, unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+         png_byte fctl[26];
+         png_zwriter::put32(fctl, _sequence++);
+         png_zwriter::put32(fctl + 4, x1 - x0);
+         png_zwriter::put32(fctl + 8, y1 - y0);
+         png_zwriter::put32(fctl + 12, x0);
+         png_zwriter::put32(fctl + 16, y0);
+         fctl[20] = 0;
+         fctl[21] = 1;
+         fctl[22] = _fps >> 8;
+         fctl[23] = _fps;
+         // dispose_op none, blend_op source
+         fctl[24] = 0;
+         fctl[25] = 0;
+         _out.write_chunk("fcTL", NULL, 0, fctl, 26);
+
+         const unsigned h = y1 - y0;
+         const size_t rowbytes = size_t(x1 - x0)*sizeof(pixel);
+         std::vector<png_bytep> rows(h);
+         for (unsigned j = 0; j < h; j++)
+            rows[j] = (png_bytep)(f.row(y0 + j) + x0);
+
+         const unsigned band = zband_rows(rowbytes);
+         const unsigned nbands = (h + band - 1) / band;
+         std::vector<zband> bands(nbands);
+         #pragma omp parallel for schedule(dynamic)
+         for (int k = 0; k < nbands; k++) {
+            unsigned y = k*band;
+            unsigned n = h - y < band ? h - y : band;
+            bands[k] = deflate_rows(rows.data() + y, n, y ? rows[y-1] : NULL, rowbytes, sizeof(pixel), _level);
+         }
+
+         uLong adler = 1;
+         bool header = true;
+         for (auto &b : bands) {
+            if (b.data.empty())
+               continue;
+            write_data(header, b.data.data(), b.data.size());
+            header = false;
+            adler = adler32_combine(adler, b.adler, b.length);
+         }
+
+         png_byte end[6];
+         png_zwriter::trailer(adler, end);
+         write_data(header, end, 6);
+      }
+
+      // Writes f, which differs from the previous frame only within changed.
+      template<typename F>
+      void write(F &f, const region &changed) {
+         if (!_out.f)
+            return;
+
+         unsigned x0 = 0, y0 = 0, x1 = _width, y1 = _height;
+         // An unchanged frame still needs a frame of its own to keep the
+         // timing, so it rewrites a single pixel.
+         if (_frames and !dirty(f, changed, x0, y0, x1, y1)) {
+            x0 = y0 = 0;
+            x1 = y1 = 1;
+         }
+         write_region(f, x0, y0, x1, y1);
+
+         for (unsigned y = y0; y < y1; y++)
+            std::memcpy(&_prev[size_t(y)*_width + x0], f.row(y) + x0, (x1 - x0)*sizeof(pixel));
+         _frames++;
+      }
+
+      template<typename F>
+      inline void write(F &f) {
+         region all;
+         all.x1 = _width;
+         all.y1 = _height;
+         write(f, all);
+      }
+
+      // Every row of a black frame.
+      struct blank {
+         std::vector<pixel> black;
+         blank(unsigned w) : black(w, pixel(0, 0, 0)) { }
+         inline pixel* row(unsigned) {
+            return black.data();
+         }
+      };
+
+      ~apng_sink() {
+         if (!_out.f)
+            return;
+         // An APNG needs at least one frame, so a movie closed before any was
+         // written shows a black one.
+         if (!_frames) {
+            blank b(_width);
+            write_region(b, 0, 0, _width, _height);
+            _frames++;
+         }
+         long end = ftell(_out.f);
+         fseek(_out.f, _actl, SEEK_SET);
+         write_actl();
+         fseek(_out.f, end, SEEK_SET);
+         _out.finish();
+      }
+   };
+
+   template<unsigned width = dynamic, unsigned height = dynamic, unsigned fps = 60, size_t buffers = 2, unsigned level = 6>
+   using apng_movie = movie<width, height, fps, level, buffers, apng_sink>;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef ATLAS_HPP
+#define ATLAS_HPP
+
+#include <image.hpp>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdlib.h>
+
+namespace im {
+
+   // Cache of rendered tiles indexed by a dense key in [0, keys). Each tile is
+   // rendered at most once, on first use, by renderer(key, tile).
+   template<unsigned width = dynamic, unsigned height = dynamic>
+   struct atlas {
+
+      unsigned _width, _height;
+      std::vector<std::unique_ptr<image<width, height>>> _tiles;
+      std::unique_ptr<std::once_flag[]> _rendered;
+
+      atlas(size_t keys, unsigned w = width, unsigned h = height) : _width(w), _height(h), _tiles(keys), _rendered(new std::once_flag[keys]) { }
+
+      inline size_t size() {
+         return _tiles.size();
+      }
+
+      template<typename renderer>
+      inline image<width, height>& get(size_t key, renderer &r) {
+         std::call_once(_rendered[key], [&]() {
+            auto tile = std::make_unique<image<width, height>>(_width, _height);
+            r(key, *tile);
+            _tiles[key] = std::move(tile);
+         });
+         return *_tiles[key];
+      }
+
+      // The tile for key, which must already have been rendered.
+      inline image<width, height>& operator[](size_t key) {
+         return *_tiles[key];
+      }
+
+      // Renders every distinct key in keys, in parallel.
+      template<typename renderer>
+      void render(const std::vector<size_t> &keys, renderer &r) {
+         std::vector<bool> seen(_tiles.size(), false);
+         std::vector<size_t> distinct;
+         for (size_t key : keys) {
+            if (!seen[key]) {
+               seen[key] = true;
+               distinct.push_back(key);
+            }
+         }
+         #pragma omp parallel for schedule(dynamic)
+         for (int k = 0; k < distinct.size(); k++)
+            get(distinct[k], r);
+      }
+   };
+}
+
+#endif
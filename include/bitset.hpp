@@ -19,7 +19,7 @@ class bitset {
 public:
    bitset(std::size_t N): N(N) {
       aloc = (N + blocksize - 1)/blocksize;
-      last_mask = set_block >> (blocksize - (N % blocksize));
+      last_mask = N % blocksize ? set_block >> (blocksize - (N % blocksize)) : set_block;
       data = std::vector<block>(aloc, reset_block);
    }
 
@@ -191,7 +191,7 @@ public:
 
    bitset<block>& reset(std::size_t pos) {
       std::size_t step = pos / blocksize;
-      block mask = ~(1 << (pos % blocksize));
+      block mask = ~(block(1) << (pos % blocksize));
       data[step] &= mask;
       return *this;
    }
@@ -200,14 +200,14 @@ public:
       if (!value)
          return this->reset(pos);
       std::size_t step = pos / blocksize;
-      block mask = 1 << (pos % blocksize);
+      block mask = block(1) << (pos % blocksize);
       data[step] |= mask;
       return *this;
    }
 
    bitset<block>& flip(size_t pos) {
       std::size_t step = pos / blocksize;
-      block mask = 1 << (pos % blocksize);
+      block mask = block(1) << (pos % blocksize);
       data[step] ^= mask;
       return *this;
    }
@@ -0,0 +1,213 @@
+#ifndef CANVAS_HPP
+#define CANVAS_HPP
+
+#include <bitset.hpp>
+#include <frame.hpp>
+#include <indexed.hpp>
+#include <pixel.hpp>
+#include <pngz.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <stdlib.h>
+#include <png.h>
+
+namespace im {
+
+   // Frame divided into tile_w x tile_h tiles, each showing the tile for some
+   // key. Setting a tile to the key it already shows does nothing, so only
+   // changed tiles are rasterized. Changed tiles are tracked until clear(),
+   // for consumers such as movie::write_frame(p, changed), and write() keeps
+   // the compressed data of every tile row, RGB or indexed, so it only
+   // re-deflates rows that changed since the last write.
+   template<unsigned width = dynamic, unsigned height = dynamic>
+   struct canvas {
+
+      static constexpr size_t none = size_t(-1);
+
+      frame<width, height> _frame;
+      unsigned _tile_w, _tile_h;
+      unsigned _cols, _rows;
+      std::vector<size_t> _keys;
+      // Tiles changed since the last clear(), and their bounding box.
+      bitset<> _dirty;
+      region _region;
+      // Tile rows whose cached zband is out of date.
+      bitset<> _stale;
+      std::vector<zband> _bands;
+      // Encoding of the cached zbands; an empty palette means RGB.
+      int _level = Z_DEFAULT_COMPRESSION;
+      std::vector<pixel> _palette;
+
+      canvas(unsigned tile_w, unsigned tile_h, unsigned w = width, unsigned h = height, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) :
+         _frame(w, h, resource), _tile_w(tile_w), _tile_h(tile_h), _cols((w + tile_w - 1) / tile_w), _rows((h + tile_h - 1) / tile_h),
+         _keys(size_t(_cols)*_rows, none), _dirty(size_t(_cols)*_rows), _stale(_rows), _bands(_rows) {
+         // Tiles showing no key are black.
+         std::memset(_frame._pixels, 0, size_t(w)*h*sizeof(pixel));
+         _stale.set();
+      }
+
+      inline unsigned get_width() const {
+         return _frame.get_width();
+      }
+
+      inline unsigned get_height() const {
+         return _frame.get_height();
+      }
+
+      inline unsigned cols() const {
+         return _cols;
+      }
+
+      inline unsigned rows() const {
+         return _rows;
+      }
+
+      inline pixel paint(unsigned x, unsigned y) {
+         return _frame.paint(x, y);
+      }
+
+      inline pixel* row(unsigned y) {
+         return _frame.row(y);
+      }
+
+      inline size_t key(unsigned i, unsigned j) const {
+         return _keys[size_t(j)*_cols + i];
+      }
+
+      // Pixels covered by tile (i, j); tiles on the right and bottom edges are
+      // clipped to the frame.
+      inline region tile_region(unsigned i, unsigned j) const {
+         region r;
+         r.x0 = i*_tile_w;
+         r.y0 = j*_tile_h;
+         r.x1 = std::min<unsigned>(r.x0 + _tile_w, get_width());
+         r.y1 = std::min<unsigned>(r.y0 + _tile_h, get_height());
+         return r;
+      }
+
+      // Shows key at tile (i, j), rasterized by r(key, view) into a view of
+      // the tile unless the tile already shows key.
+      template<typename renderer>
+      inline void set(unsigned i, unsigned j, size_t key, renderer &r) {
+         size_t &k = _keys[size_t(j)*_cols + i];
+         if (k == key)
+            return;
+         k = key;
+         region t = tile_region(i, j);
+         auto v = _frame.view(t.x0, t.y0, t.x1 - t.x0, t.y1 - t.y0);
+         r(key, v);
+         mark(i, j);
+      }
+
+      // Marks tile (i, j) as changed, for edits made directly to the frame.
+      inline void mark(unsigned i, unsigned j) {
+         _dirty.set(size_t(j)*_cols + i);
+         _stale.set(j);
+         _region.add(tile_region(i, j));
+      }
+
+      inline bool dirty(unsigned i, unsigned j) const {
+         return _dirty[size_t(j)*_cols + i];
+      }
+
+      inline const bitset<>& dirty_tiles() const {
+         return _dirty;
+      }
+
+      // Bounding box of the tiles changed since the last clear().
+      inline region dirty_region() const {
+         return _region;
+      }
+
+      inline void clear() {
+         _dirty.reset();
+         _region = region();
+      }
+
+      // Writes the frame as an RGB PNG.
+      int write(const char* fname, int level = Z_DEFAULT_COMPRESSION) {
+         return write_png(fname, std::vector<pixel>(), level);
+      }
+
+      // Writes the frame as a PNG indexing palette at the smallest bit depth
+      // that holds it, for canvases drawn in a few colors. Returns 12 without
+      // writing if the frame holds a color missing from palette; throws
+      // std::invalid_argument if palette is empty or has over 256 colors.
+      int write(const char* fname, const std::vector<pixel> &palette, int level = Z_DEFAULT_COMPRESSION) {
+         if (palette.empty() or palette.size() > 256)
+            throw std::invalid_argument("palette size does not fit a PNG");
+         return write_png(fname, palette, level);
+      }
+
+      // Deflates the stale tile rows, RGB if palette is empty and indexed
+      // otherwise. Every cached zband is stale once the level or palette
+      // differs from the last write.
+      int write_png(const char* fname, const std::vector<pixel> &palette, int level) {
+         const unsigned w = get_width();
+         const unsigned h = get_height();
+         const unsigned bits = palette.empty() ? 8 : palette_bits(palette.size());
+         const unsigned bpp = palette.empty() ? sizeof(pixel) : 1;
+         const size_t rowbytes = palette.empty() ? w*sizeof(pixel) : (size_t(w)*bits + 7) / 8;
+         if (level != _level or palette != _palette) {
+            _stale.set();
+            _level = level;
+            _palette = palette;
+         }
+
+         // Each tile row starts with a Sub filtered row, so its zband does
+         // not depend on the row above and stays valid while that one
+         // changes.
+         std::vector<unsigned> stale;
+         for (unsigned j = 0; j < _rows; j++)
+            if (_stale[j])
+               stale.push_back(j);
+         png_bytepp frame_rows = (png_bytepp)_frame._pixel_rows;
+         bool unmatched = false;
+         #pragma omp parallel for schedule(dynamic)
+         for (int k = 0; k < stale.size(); k++) {
+            unsigned y = stale[k]*_tile_h;
+            unsigned n = std::min(_tile_h, h - y);
+            if (palette.empty()) {
+               _bands[stale[k]] = deflate_rows(frame_rows + y, n, NULL, rowbytes, bpp, level);
+               continue;
+            }
+            std::vector<png_byte> packed(n*rowbytes);
+            std::vector<png_bytep> rows(n);
+            bool missing = false;
+            for (unsigned j = 0; j < n; j++) {
+               rows[j] = packed.data() + j*rowbytes;
+               const pixel* src = _frame.row(y + j);
+               for (unsigned x = 0; x < w; x++) {
+                  auto c = std::find(palette.begin(), palette.end(), src[x]);
+                  if (c == palette.end())
+                     missing = true;
+                  else
+                     rows[j][x*bits / 8] |= png_byte(c - palette.begin()) << (8 - bits - x*bits % 8);
+               }
+            }
+            if (missing) {
+               #pragma omp atomic write
+               unmatched = true;
+               continue;
+            }
+            _bands[stale[k]] = deflate_rows(rows.data(), n, NULL, rowbytes, bpp, level);
+         }
+         if (unmatched)
+            return 12;
+         _stale.reset();
+
+         png_zwriter out;
+         int err = out.open(fname, w, h, bits, palette.empty() ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_PALETTE, level, palette.empty() ? NULL : &palette);
+         if (err)
+            return err;
+         for (auto &band : _bands)
+            out.write(band);
+         return out.close();
+      }
+   };
+}
+
+#endif
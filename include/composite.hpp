@@ -0,0 +1,41 @@
+#ifndef COMPOSITE_HPP
+#define COMPOSITE_HPP
+
+#include <image.hpp>
+#include <scratch.hpp>
+
+#include <stdlib.h>
+
+namespace im {
+
+   // Paints the n x m grid of tile_w x tile_h tiles into dst. Tile (i, j) is
+   // rendered by r(i, j, scratch) into a scratch_image owned by the calling
+   // thread and allocated from its scratch pool, then painted at
+   // (i*tile_w, j*tile_h), clipped to dst. Tiles are handed out dynamically,
+   // so threads that draw cheap tiles take more of them. Views of dst over
+   // disjoint tiles must be safe to paint concurrently; for a packed
+   // indexed_image, tile_w*bits must be a multiple of 8.
+   template<typename scratch_image = image<>, typename F, typename renderer>
+   void composite(F &dst, size_t n, size_t m, unsigned tile_w, unsigned tile_h, renderer &r) {
+      const size_t w = dst.get_width();
+      const size_t h = dst.get_height();
+      #pragma omp parallel
+      {
+         scratch_image scratch(tile_w, tile_h, scratch_resource());
+         #pragma omp for schedule(dynamic)
+         for (long k = 0; k < long(n*m); k++) {
+            size_t i = k / m;
+            size_t j = k % m;
+            size_t x = i*tile_w;
+            size_t y = j*tile_h;
+            if (x >= w or y >= h)
+               continue;
+            r(i, j, scratch);
+            auto v = dst.view(x, y, w - x < tile_w ? w - x : tile_w, h - y < tile_h ? h - y : tile_h);
+            v.paint(scratch);
+         }
+      }
+   }
+}
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef DOWNSAMPLE_HPP
+#define DOWNSAMPLE_HPP
+
+#include <frame.hpp>
+#include <pixel.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <immintrin.h>
+
+namespace im {
+
+   // Filters for halving an image. box averages each 2 x 2 block; tent
+   // weighs the 4 x 4 neighborhood of a block by (1 3 3 1)/8 along each axis,
+   // with edge pixels repeated, which blurs less along diagonal edges.
+   enum filter { box, tent };
+
+   // Vertical passes, one 16-bit sum per byte of the packed RGB rows. These
+   // are plain loops over contiguous bytes, compiled for AVX2 and for the
+   // baseline SSE2 and picked at load time.
+
+   __attribute__((target_clones("avx2", "default")))
+   inline void box_column(const png_byte* a, const png_byte* b, size_t n, uint16_t* v) {
+      for (size_t k = 0; k < n; k++)
+         v[k] = a[k] + b[k];
+   }
+
+   __attribute__((target_clones("avx2", "default")))
+   inline void tent_column(const png_byte* a, const png_byte* b, const png_byte* c, const png_byte* d, size_t n, uint16_t* v) {
+      for (size_t k = 0; k < n; k++)
+         v[k] = a[k] + 3*(b[k] + c[k]) + d[k];
+   }
+
+   // Adds a row of n bytes into 32-bit sums, for reductions by factors too
+   // large for 16 bits.
+   __attribute__((target_clones("avx2", "default")))
+   inline void sum_column(const png_byte* a, size_t n, uint32_t* v) {
+      for (size_t k = 0; k < n; k++)
+         v[k] += a[k];
+   }
+
+   // Horizontal passes over the column sums v of a w pixel row, writing
+   // (w + 1)/2 pixels. Output channel c of pixel i reads sums 6i + c + 3t,
+   // a stride the compiler does not vectorize, so the AVX2 versions add
+   // shifted loads of 16 sums and gather the 9 bytes of 3 output pixels
+   // with a byte shuffle.
+
+   inline void box_row_scalar(const uint16_t* v, size_t w, size_t i, png_byte* o) {
+      const size_t pairs = w / 2;
+      for (; i < pairs; i++)
+         for (int c = 0; c < 3; c++)
+            o[3*i + c] = (v[6*i + c] + v[6*i + 3 + c] + 2) >> 2;
+      if (w % 2)
+         for (int c = 0; c < 3; c++)
+            o[3*pairs + c] = (2*v[6*pairs + c] + 2) >> 2;
+   }
+
+   inline void tent_row_scalar(const uint16_t* v, size_t w, size_t i, size_t end, png_byte* o) {
+      for (; i < end; i++) {
+         size_t x0 = i ? 2*i - 1 : 0;
+         size_t x1 = 2*i;
+         size_t x2 = 2*i + 1 < w ? 2*i + 1 : w - 1;
+         size_t x3 = 2*i + 2 < w ? 2*i + 2 : w - 1;
+         for (int c = 0; c < 3; c++)
+            o[3*i + c] = (v[3*x0 + c] + 3*(v[3*x1 + c] + v[3*x2 + c]) + v[3*x3 + c] + 32) >> 6;
+      }
+   }
+
+   // Picks bytes 0-2, 6-8 and 12-14 of the rounded sums s.
+   __attribute__((target("avx2")))
+   inline void store_pixels3(__m256i s, png_byte* o) {
+      const __m128i pick = _mm_setr_epi8(0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1);
+      __m128i b = _mm_packus_epi16(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+      _mm_storeu_si128((__m128i*)o, _mm_shuffle_epi8(b, pick));
+   }
+
+   __attribute__((target("avx2")))
+   inline void box_row_avx2(const uint16_t* v, size_t w, png_byte* o) {
+      const __m256i two = _mm256_set1_epi16(2);
+      size_t i = 0;
+      for (; i + 6 <= w / 2; i += 3) {
+         __m256i x = _mm256_loadu_si256((const __m256i*)(v + 6*i));
+         __m256i y = _mm256_loadu_si256((const __m256i*)(v + 6*i + 3));
+         __m256i s = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, y), two), 2);
+         store_pixels3(s, o + 3*i);
+      }
+      box_row_scalar(v, w, i, o);
+   }
+
+   __attribute__((target("avx2")))
+   inline void tent_row_avx2(const uint16_t* v, size_t w, png_byte* o) {
+      const __m256i half = _mm256_set1_epi16(32);
+      // Pixel 0 clamps its left neighbor.
+      tent_row_scalar(v, w, 0, 1, o);
+      size_t i = 1;
+      for (; i + 7 <= w / 2; i += 3) {
+         __m256i a = _mm256_loadu_si256((const __m256i*)(v + 6*i - 3));
+         __m256i b = _mm256_loadu_si256((const __m256i*)(v + 6*i));
+         __m256i c = _mm256_loadu_si256((const __m256i*)(v + 6*i + 3));
+         __m256i d = _mm256_loadu_si256((const __m256i*)(v + 6*i + 6));
+         __m256i bc = _mm256_add_epi16(b, c);
+         __m256i s = _mm256_add_epi16(_mm256_add_epi16(a, d), _mm256_add_epi16(bc, _mm256_add_epi16(bc, bc)));
+         store_pixels3(_mm256_srli_epi16(_mm256_add_epi16(s, half), 6), o + 3*i);
+      }
+      tent_row_scalar(v, w, i, (w + 1) / 2, o);
+   }
+
+   inline bool has_avx2() {
+      static const bool avx2 = __builtin_cpu_supports("avx2");
+      return avx2;
+   }
+
+   inline void box_row(const uint16_t* v, size_t w, pixel* out) {
+      if (has_avx2())
+         box_row_avx2(v, w, (png_byte*)out);
+      else
+         box_row_scalar(v, w, 0, (png_byte*)out);
+   }
+
+   inline void tent_row(const uint16_t* v, size_t w, pixel* out) {
+      if (has_avx2())
+         tent_row_avx2(v, w, (png_byte*)out);
+      else
+         tent_row_scalar(v, w, 0, (w + 1) / 2, (png_byte*)out);
+   }
+
+   // Column sums of a row of w pixels, reused per thread.
+   inline uint16_t* column_sums(size_t w) {
+      thread_local std::vector<uint16_t> v;
+      if (v.size() < 3*w)
+         v.resize(3*w);
+      return v.data();
+   }
+
+   // Halves rows a and b of w pixels into one row of (w + 1)/2 pixels, each
+   // the rounded mean of a 2 x 2 block. An odd last column is paired with
+   // itself, as is a last row passed as both a and b.
+   inline void halve_rows(const pixel* a, const pixel* b, size_t w, pixel* out) {
+      uint16_t* v = column_sums(w);
+      box_column((const png_byte*)a, (const png_byte*)b, 3*w, v);
+      box_row(v, w, out);
+   }
+
+   // Writes the half size image of src, rounded up, into dst, which must be
+   // ((w + 1)/2) x ((h + 1)/2). Output rows are split over threads as in
+   // frame::paint.
+   // src is a row_painter, such as a frame, or a span_painter, whose rows
+   // are copied into per-thread buffers.
+   template<typename S, typename D>
+   void halve(S &src, D &dst, filter f = box) {
+      const size_t w = src.get_width();
+      const size_t h = src.get_height();
+      const size_t oh = (h + 1) / 2;
+      #pragma omp parallel
+      {
+         std::vector<pixel> buffers[4];
+         auto row = [&](size_t y, int k) -> const png_byte* {
+            if constexpr (row_painter<S>) {
+               return (const png_byte*)src.row(y);
+            }
+            else {
+               buffers[k].resize(w);
+               src.span(0, y, w, buffers[k].data());
+               return (const png_byte*)buffers[k].data();
+            }
+         };
+         #pragma omp for schedule(static)
+         for (int j = 0; j < oh; j++) {
+            uint16_t* v = column_sums(w);
+            if (f == box) {
+               size_t y1 = 2*j + 1 < h ? 2*j + 1 : h - 1;
+               box_column(row(2*j, 0), row(y1, 1), 3*w, v);
+               box_row(v, w, dst.row(j));
+            }
+            else {
+               size_t y0 = j ? 2*j - 1 : 0;
+               size_t y2 = 2*j + 1 < h ? 2*j + 1 : h - 1;
+               size_t y3 = 2*j + 2 < h ? 2*j + 2 : h - 1;
+               tent_column(row(y0, 0), row(2*j, 1), row(y2, 2), row(y3, 3), 3*w, v);
+               tent_row(v, w, dst.row(j));
+            }
+         }
+      }
+   }
+
+   // Writes src reduced by factor, a power of two of at least 2, into dst,
+   // halving repeatedly with f. dst must be src's size divided by factor,
+   // rounded up. Returns 1, writing nothing, for any other factor.
+   template<typename S, typename D>
+   int downsample(S &src, D &dst, unsigned factor, filter f = box) {
+      if (factor < 2 or (factor & (factor - 1)))
+         return 1;
+      if (factor == 2) {
+         halve(src, dst, f);
+         return 0;
+      }
+      frame<> half((src.get_width() + 1) / 2, (src.get_height() + 1) / 2);
+      halve(src, half, f);
+      return downsample(half, dst, factor / 2, f);
+   }
+
+   // Throws std::invalid_argument unless factor is a power of two of at
+   // least 2.
+   template<typename S>
+   frame<> downsample(S &src, unsigned factor, filter f = box) {
+      if (factor < 2 or (factor & (factor - 1)))
+         throw std::invalid_argument("downsample factor must be a power of two of at least 2");
+      frame<> out((src.get_width() + factor - 1) / factor, (src.get_height() + factor - 1) / factor);
+      downsample(src, out, factor, f);
+      return out;
+   }
+
+   // Thumbnail of an image reduced factor times by a box filter: pixel
+   // (X, Y) is the rounded mean of the factor x factor block at
+   // (factor X, factor Y), clipped to the image. Bands of rows may be added
+   // from any thread in any order, so an image written band by band in
+   // parallel gets its thumbnail in the same parallel pass, without being
+   // held whole. A block split between bands is summed per band and
+   // finished by whichever part arrives last.
+   struct box_thumbnail {
+
+      struct partial {
+         std::vector<uint32_t> sums;
+         size_t rows = 0;
+      };
+
+      size_t _width, _height;
+      unsigned _factor;
+      std::mutex _lock;
+      std::map<size_t, partial> _partial;
+      frame<> out;
+
+      box_thumbnail(size_t width, size_t height, unsigned factor) :
+         _width(width), _height(height), _factor(factor), out((width + factor - 1) / factor, (height + factor - 1) / factor) { }
+
+      // Per block column, the sums of each channel over rows [0, n). The
+      // vertical pass, factor rows per block, is the vectorized sum_column;
+      // the horizontal one touches each column sum once and stays scalar.
+      inline void block_sums(pixel** rows, size_t n, uint32_t* sums) {
+         thread_local std::vector<uint32_t> column;
+         column.assign(3*_width, 0);
+         for (size_t j = 0; j < n; j++)
+            sum_column((const png_byte*)rows[j], 3*_width, column.data());
+         for (size_t x0 = 0, X = 0; x0 < _width; x0 += _factor, X++) {
+            const size_t x1 = std::min(x0 + _factor, _width);
+            uint32_t s[3] = {0, 0, 0};
+            for (size_t x = x0; x < x1; x++)
+               for (int c = 0; c < 3; c++)
+                  s[c] += column[3*x + c];
+            for (int c = 0; c < 3; c++)
+               sums[3*X + c] = s[c];
+         }
+      }
+
+      inline void finish(size_t Y, size_t rows, const uint32_t* sums) {
+         png_byte* o = (png_byte*)out.row(Y);
+         for (size_t x0 = 0, X = 0; x0 < _width; x0 += _factor, X++) {
+            const uint32_t n = (std::min(x0 + _factor, _width) - x0)*rows;
+            for (int c = 0; c < 3; c++)
+               o[3*X + c] = (sums[3*X + c] + n/2) / n;
+         }
+      }
+
+      // Adds image rows [y, y + n), held in rows.
+      void write_band(size_t y, pixel** rows, size_t n) {
+         thread_local std::vector<uint32_t> sums;
+         sums.resize(3*out.get_width());
+         const size_t end = y + n;
+         while (y < end) {
+            const size_t Y = y / _factor;
+            const size_t b0 = Y*_factor;
+            const size_t b1 = std::min(b0 + _factor, _height);
+            const size_t k = std::min(b1, end) - y;
+            block_sums(rows, k, sums.data());
+            if (y == b0 and y + k == b1) {
+               finish(Y, k, sums.data());
+            }
+            else {
+               std::lock_guard<std::mutex> guard(_lock);
+               partial &p = _partial[Y];
+               if (p.sums.empty())
+                  p.sums.assign(sums.size(), 0);
+               for (size_t i = 0; i < sums.size(); i++)
+                  p.sums[i] += sums[i];
+               p.rows += k;
+               if (p.rows == b1 - b0) {
+                  finish(Y, b1 - b0, p.sums.data());
+                  _partial.erase(Y);
+               }
+            }
+            rows += k;
+            y += k;
+         }
+      }
+   };
+}
+
+#endif
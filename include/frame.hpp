@@ -4,51 +4,169 @@
 
 #include <pixel.hpp>
 
+#include <concepts>
+#include <cstring>
 #include <functional>
+#include <memory_resource>
+#include <utility>
 #include <vector>
 #include <stdlib.h>
 #include <png.h>
 
 namespace im {
 
-   template<size_t width, size_t height>
+   // A painter whose output row y is available as contiguous pixels, so it
+   // can be copied a row at a time instead of through paint(x, y).
+   template<typename painter>
+   concept row_painter = requires(painter &p, unsigned y) {
+      { p.row(y) } -> std::convertible_to<const pixel*>;
+   };
+
+   // A painter that copies n pixels of row y from column x into a buffer of
+   // the caller's, for painters that have no rows of their own to point to.
+   template<typename painter>
+   concept span_painter = requires(painter &p, unsigned x, unsigned y, unsigned n, pixel* out) {
+      p.span(x, y, n, out);
+   };
+
+   // Dimension value selecting a size given at runtime instead of a template
+   // argument, e.g. frame<> f(w, h). Fixed-size frames keep their dimensions
+   // as compile-time constants.
+   inline constexpr size_t dynamic = 0;
+
+   // The pixel rectangle [x0, x1) x [y0, y1).
+   struct region {
+      unsigned x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+      inline bool empty() const {
+         return x1 <= x0 or y1 <= y0;
+      }
+
+      // Grows this region to the bounding box of itself and r.
+      inline void add(const region &r) {
+         if (r.empty())
+            return;
+         if (empty()) {
+            *this = r;
+            return;
+         }
+         x0 = r.x0 < x0 ? r.x0 : x0;
+         y0 = r.y0 < y0 ? r.y0 : y0;
+         x1 = r.x1 > x1 ? r.x1 : x1;
+         y1 = r.y1 > y1 ? r.y1 : y1;
+      }
+   };
+
+   template<size_t width = dynamic, size_t height = dynamic>
    struct frame_view;
 
-   template<size_t width, size_t height>
+   template<size_t width = dynamic, size_t height = dynamic>
    struct frame {
 
+      // Pixel storage is aligned to a cache line.
+      static constexpr size_t alignment = 64;
+
+      size_t _width, _height;
       pixel* _pixels;
       pixel** _pixel_rows;
+      std::pmr::memory_resource* _resource;
+
+      // Storage comes from resource, which must outlive the frame.
+      frame(size_t w = width, size_t h = height, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) : _width(w), _height(h), _resource(resource) {
+         _pixels = (pixel*)resource->allocate(w*h*sizeof(pixel), alignment);
+         _pixel_rows = (pixel**)resource->allocate(h*sizeof(pixel*), alignof(pixel*));
+         for (int j = 0; j < h; j++)
+            _pixel_rows[j] = &_pixels[j*w];
+      }
+
+      // Frames own their pixels, so they move but do not copy. A moved-from
+      // frame is empty, and views keep pointing at the frame they were taken
+      // from.
+      frame(const frame&) = delete;
+      frame& operator=(const frame&) = delete;
+
+      frame(frame &&other) noexcept : _width(other._width), _height(other._height), _pixels(other._pixels), _pixel_rows(other._pixel_rows), _resource(other._resource) {
+         other._width = other._height = 0;
+         other._pixels = NULL;
+         other._pixel_rows = NULL;
+      }
 
-      frame() {
-         _pixels = new pixel[width * height];
-         _pixel_rows = new pixel*[height];
-         for (int j = 0; j < height; j++)
-            _pixel_rows[j] = &_pixels[j*width];
+      frame& operator=(frame &&other) noexcept {
+         swap(other);
+         return *this;
+      }
+
+      inline void swap(frame &other) noexcept {
+         std::swap(_width, other._width);
+         std::swap(_height, other._height);
+         std::swap(_pixels, other._pixels);
+         std::swap(_pixel_rows, other._pixel_rows);
+         std::swap(_resource, other._resource);
+      }
+
+      inline size_t get_width() const {
+         if constexpr (width != dynamic)
+            return width;
+         return _width;
+      }
+
+      inline size_t get_height() const {
+         if constexpr (height != dynamic)
+            return height;
+         return _height;
       }
 
       frame_view<width, height> view(size_t i, size_t j, size_t n, size_t m) {
          return frame_view<width, height>(this, i, j, n, m);
       }
 
+      // Rows are split evenly over threads in order (schedule(static)), the
+      // partition huge_page_resource first touches pages in.
       template<typename painter>
       inline void paint(painter &p) {
-         #pragma omp parallel for schedule(guided)
-         for (int j = 0; j < height; j++) {
-            int idx = j*width;
-            for (int i = 0; i < width; i++) {
+         if constexpr (row_painter<painter>) {
+            blit(p);
+            return;
+         }
+         const size_t w = get_width();
+         const size_t h = get_height();
+         if constexpr (span_painter<painter>) {
+            #pragma omp parallel for schedule(static)
+            for (int j = 0; j < h; j++)
+               p.span(0, j, w, _pixel_rows[j]);
+            return;
+         }
+         #pragma omp parallel for schedule(static)
+         for (int j = 0; j < h; j++) {
+            size_t idx = j*w;
+            for (int i = 0; i < w; i++) {
                _pixels[idx++] = p.paint(i,j);
             }
          }
       }
 
+      template<row_painter painter>
+      inline void blit(painter &p) {
+         const size_t w = get_width();
+         const size_t h = get_height();
+         #pragma omp parallel for schedule(static)
+         for (int j = 0; j < h; j++)
+            std::memcpy(_pixel_rows[j], p.row(j), w*sizeof(pixel));
+      }
+
       inline pixel paint(unsigned x, unsigned y) {
-         return _pixels[y*width + x];
+         return _pixels[y*get_width() + x];
+      }
+
+      inline pixel* row(unsigned y) {
+         return _pixel_rows[y];
       }
 
       ~frame() {
-         delete[] _pixels;
-         delete[] _pixel_rows;
+         if (!_pixels)
+            return;
+         _resource->deallocate(_pixels, _width*_height*sizeof(pixel), alignment);
+         _resource->deallocate(_pixel_rows, _height*sizeof(pixel*), alignof(pixel*));
       }
    };
 
@@ -67,16 +185,36 @@ namespace im {
 
       template<typename painter>
       inline void paint(painter &p) {
+         if constexpr (row_painter<painter>) {
+            blit(p);
+            return;
+         }
+         if constexpr (span_painter<painter>) {
+            for (int j = 0; j < m; j++)
+               p.span(0, j, n, row(j));
+            return;
+         }
+         const size_t w = parent->get_width();
          for (int j = 0; j < m; j++) {
-            int idx = (init_j+j)*width + init_i;
+            size_t idx = (init_j+j)*w + init_i;
             for (int i = 0; i < n; i++) {
                parent->_pixels[idx++] = p.paint(i,j);
             }
          }
       }
 
+      template<row_painter painter>
+      inline void blit(painter &p) {
+         for (int j = 0; j < m; j++)
+            std::memcpy(row(j), p.row(j), n*sizeof(pixel));
+      }
+
       inline pixel paint(unsigned x, unsigned y) {
-         return parent->_pixels[(init_j+y)*width + init_i + x];
+         return parent->_pixels[(init_j+y)*parent->get_width() + init_i + x];
+      }
+
+      inline pixel* row(unsigned y) {
+         return &parent->_pixels[(init_j+y)*parent->get_width() + init_i];
       }
    };
 }
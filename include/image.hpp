@@ -3,8 +3,11 @@
 
 #include <pixel.hpp>
 #include <frame.hpp>
+#include <pngz.hpp>
 
 #include <functional>
+#include <memory_resource>
+#include <vector>
 #include <stdlib.h>
 #include <png.h>
 
@@ -12,7 +15,7 @@
 
 namespace im {
 
-   template<unsigned width, unsigned height>
+   template<unsigned width = dynamic, unsigned height = dynamic>
    struct image {
       
    private:
@@ -31,6 +34,19 @@ namespace im {
 
       im::frame<width, height> _image;
 
+      image(unsigned w = width, unsigned h = height, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) : _image(w, h, resource) { }
+
+      image(image&&) noexcept = default;
+      image& operator=(image&&) noexcept = default;
+
+      inline unsigned get_width() const {
+         return _image.get_width();
+      }
+
+      inline unsigned get_height() const {
+         return _image.get_height();
+      }
+
       template<typename painter>
       inline void paint_frame(painter &p) {
          _image.paint(p);
@@ -40,6 +56,10 @@ namespace im {
          return _image.paint(x,y);
       }
 
+      inline pixel* row(unsigned y) {
+         return _image.row(y);
+      }
+
       int read(const char* fname) {
          FILE* f = fopen(fname, "rb");
          if (!f) {
@@ -85,10 +105,10 @@ namespace im {
             png_set_strip_alpha(png_ptr);
 
          unsigned f_width = png_get_image_width(png_ptr, info_ptr);
-         if (f_width != width)
+         if (f_width != get_width())
             return 6;
          unsigned f_height = png_get_image_height(png_ptr, info_ptr);
-         if (f_height != height)
+         if (f_height != get_height())
             return 7;
 
          png_read_image(png_ptr, (png_bytepp)_image._pixel_rows);
@@ -123,7 +143,7 @@ namespace im {
          }
 
          png_init_io(png_ptr, f);
-         png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+         png_set_IHDR(png_ptr, info_ptr, get_width(), get_height(), 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
          png_write_info(png_ptr, info_ptr);
          
          png_write_image(png_ptr, (png_bytepp)_image._pixel_rows);
@@ -135,6 +155,33 @@ namespace im {
 
          return 0;
       }
+
+      // Same output format as write, but bands of rows are filtered and
+      // deflated on all threads and stitched into a single zlib stream.
+      int write_parallel(const char* fname, int level = Z_DEFAULT_COMPRESSION) {
+         const unsigned w = get_width();
+         const unsigned h = get_height();
+         const size_t rowbytes = w*sizeof(pixel);
+         const unsigned rows = zband_rows(rowbytes);
+         const unsigned nbands = (h + rows - 1) / rows;
+         png_bytepp image_rows = (png_bytepp)_image._pixel_rows;
+
+         std::vector<zband> bands(nbands);
+         #pragma omp parallel for schedule(dynamic)
+         for (int k = 0; k < nbands; k++) {
+            unsigned y = k*rows;
+            unsigned n = h - y < rows ? h - y : rows;
+            bands[k] = deflate_rows(image_rows + y, n, y ? image_rows[y-1] : NULL, rowbytes, sizeof(pixel), level);
+         }
+
+         png_zwriter out;
+         int err = out.open(fname, w, h, 8, PNG_COLOR_TYPE_RGB, level);
+         if (err)
+            return err;
+         for (auto &band : bands)
+            out.write(band);
+         return out.close();
+      }
    };
 }
 
@@ -0,0 +1,224 @@
+#ifndef INDEXED_HPP
+#define INDEXED_HPP
+
+#include <frame.hpp>
+#include <pixel.hpp>
+#include <pngz.hpp>
+
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <stdlib.h>
+#include <png.h>
+
+namespace im {
+
+   // Smallest PNG bit depth able to index a palette of n colors.
+   constexpr unsigned palette_bits(size_t n) {
+      return n <= 2 ? 1 : n <= 4 ? 2 : n <= 16 ? 4 : 8;
+   }
+
+   template<unsigned width = dynamic, unsigned height = dynamic, unsigned bits = 8>
+   struct indexed_view;
+
+   // Palette-indexed image storing bits bits per pixel, packed most
+   // significant bits first, which is the PNG scanline layout.
+   template<unsigned width = dynamic, unsigned height = dynamic, unsigned bits = 8>
+   struct indexed_image {
+
+      static_assert(bits == 1 or bits == 2 or bits == 4 or bits == 8);
+
+      static constexpr unsigned per_byte = 8 / bits;
+      static constexpr png_byte mask = (1 << bits) - 1;
+
+      unsigned _width, _height;
+      std::vector<pixel> palette;
+      png_byte* _data;
+      png_byte** _rows;
+      // Set when a color missing from the palette was painted; the image
+      // then refuses to be written.
+      bool unmatched = false;
+
+      // Throws std::invalid_argument if palette is empty or has more colors
+      // than bits can index.
+      indexed_image(std::vector<pixel> palette, unsigned w = width, unsigned h = height) : _width(w), _height(h), palette(palette) {
+         if (palette.empty() or palette.size() > (size_t(1) << bits))
+            throw std::invalid_argument("palette size does not fit the bit depth");
+         const size_t stride = get_stride();
+         _data = new png_byte[stride * h]();
+         _rows = new png_byte*[h];
+         for (int j = 0; j < h; j++)
+            _rows[j] = &_data[j*stride];
+      }
+
+      indexed_image(const indexed_image&) = delete;
+      indexed_image& operator=(const indexed_image&) = delete;
+
+      indexed_image(indexed_image &&other) noexcept : _width(other._width), _height(other._height), palette(std::move(other.palette)), _data(other._data), _rows(other._rows), unmatched(other.unmatched) {
+         other._width = other._height = 0;
+         other._data = NULL;
+         other._rows = NULL;
+      }
+
+      indexed_image& operator=(indexed_image &&other) noexcept {
+         std::swap(_width, other._width);
+         std::swap(_height, other._height);
+         std::swap(palette, other.palette);
+         std::swap(_data, other._data);
+         std::swap(_rows, other._rows);
+         std::swap(unmatched, other.unmatched);
+         return *this;
+      }
+
+      inline unsigned get_width() const {
+         if constexpr (width != dynamic)
+            return width;
+         return _width;
+      }
+
+      inline unsigned get_height() const {
+         if constexpr (height != dynamic)
+            return height;
+         return _height;
+      }
+
+      // Bytes per packed row.
+      inline size_t get_stride() const {
+         return (get_width()*bits + 7) / 8;
+      }
+
+      inline png_byte get(unsigned x, unsigned y) {
+         unsigned shift = (per_byte - 1 - x % per_byte) * bits;
+         return (_rows[y][x / per_byte] >> shift) & mask;
+      }
+
+      inline void set(unsigned x, unsigned y, png_byte idx) {
+         unsigned shift = (per_byte - 1 - x % per_byte) * bits;
+         png_byte &b = _rows[y][x / per_byte];
+         b = (b & ~(mask << shift)) | ((idx & mask) << shift);
+      }
+
+      // Palette index of c. A color missing from the palette is stored as
+      // index 0 and marks the image unmatched.
+      inline png_byte index(pixel c) {
+         for (size_t k = 0; k < palette.size(); k++)
+            if (palette[k] == c)
+               return k;
+         #pragma omp atomic write
+         unmatched = true;
+         return 0;
+      }
+
+      indexed_view<width, height, bits> view(size_t i, size_t j, size_t n, size_t m) {
+         return indexed_view<width, height, bits>(this, i, j, n, m);
+      }
+
+      template<typename painter>
+      inline void paint_frame(painter &p) {
+         const unsigned w = get_width();
+         const unsigned h = get_height();
+         #pragma omp parallel for schedule(guided)
+         for (int j = 0; j < h; j++)
+            for (int i = 0; i < w; i++)
+               set(i, j, index(p.paint(i,j)));
+      }
+
+      inline pixel paint(unsigned x, unsigned y) {
+         return palette[get(x,y)];
+      }
+
+      // Returns 12 without writing if a color outside the palette was painted.
+      int write(const char* fname) {
+         if (unmatched)
+            return 12;
+
+         png_structp png_ptr;
+         png_infop info_ptr;
+
+         png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+         if (!png_ptr) {
+            return 1;
+         }
+
+         info_ptr = png_create_info_struct(png_ptr);
+         if (!info_ptr) {
+            png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+            return 2;
+         }
+
+         FILE* f = fopen(fname, "wb");
+         if (!f) {
+            return 3;
+         }
+
+         png_init_io(png_ptr, f);
+         png_set_IHDR(png_ptr, info_ptr, get_width(), get_height(), bits, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+         png_set_PLTE(png_ptr, info_ptr, (png_colorp)palette.data(), palette.size());
+         png_write_info(png_ptr, info_ptr);
+
+         png_write_image(png_ptr, _rows);
+         png_write_end(png_ptr, NULL);
+         png_destroy_write_struct(&png_ptr, &info_ptr);
+
+         fclose(f);
+         f = NULL;
+
+         return 0;
+      }
+
+      int write_parallel(const char* fname, int level = Z_DEFAULT_COMPRESSION) {
+         if (unmatched)
+            return 12;
+
+         const unsigned w = get_width();
+         const unsigned h = get_height();
+         const size_t stride = get_stride();
+         const unsigned rows = zband_rows(stride);
+         const unsigned nbands = (h + rows - 1) / rows;
+
+         std::vector<zband> bands(nbands);
+         #pragma omp parallel for schedule(dynamic)
+         for (int k = 0; k < nbands; k++) {
+            unsigned y = k*rows;
+            unsigned n = h - y < rows ? h - y : rows;
+            bands[k] = deflate_rows(_rows + y, n, y ? _rows[y-1] : NULL, stride, 1, level);
+         }
+
+         png_zwriter out;
+         int err = out.open(fname, w, h, bits, PNG_COLOR_TYPE_PALETTE, level, &palette);
+         if (err)
+            return err;
+         for (auto &band : bands)
+            out.write(band);
+         return out.close();
+      }
+
+      ~indexed_image() {
+         delete[] _data;
+         delete[] _rows;
+      }
+   };
+
+   template<unsigned width, unsigned height, unsigned bits>
+   struct indexed_view {
+
+      const size_t init_i, init_j;
+      const size_t n, m;
+      indexed_image<width, height, bits>* parent;
+
+      indexed_view(indexed_image<width, height, bits>* parent, size_t i, size_t j, size_t n, size_t m): parent(parent), init_i(i), init_j(j), n(n), m(m) { }
+
+      template<typename painter>
+      inline void paint(painter &p) {
+         for (int j = 0; j < m; j++)
+            for (int i = 0; i < n; i++)
+               parent->set(init_i + i, init_j + j, parent->index(p.paint(i,j)));
+      }
+
+      inline pixel paint(unsigned x, unsigned y) {
+         return parent->paint(init_i + x, init_j + y);
+      }
+   };
+}
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef MAPPED_HPP
+#define MAPPED_HPP
+
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <utility>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace im {
+
+   // Memory resource backed by a file. Allocations of at least threshold bytes
+   // are appended to the file and mapped shared, so frames larger than
+   // memory page in and out through the page cache instead of failing to
+   // allocate; smaller ones, like a frame's row table, come from upstream.
+   // The first large allocation starts at offset 0, so the pixels of a frame
+   // allocated first are the file's raw RGB contents. Unless keep is set the
+   // file is unlinked once opened and its blocks are released on
+   // deallocation. Not thread-safe.
+   struct mapped_resource : std::pmr::memory_resource {
+
+      static constexpr size_t huge_page = size_t(1) << 21;
+
+      int _fd;
+      bool _keep, _huge;
+      size_t _size = 0;
+      std::map<void*, std::pair<off_t, size_t>> _maps;
+      std::pmr::memory_resource* _upstream;
+
+      size_t threshold = size_t(1) << 24;
+      // madvise advice for new mappings, e.g. MADV_SEQUENTIAL when frames are
+      // filled and written one band at a time.
+      int advice = MADV_NORMAL;
+
+      // With huge set, mappings are 2 MB aligned and ask for huge pages:
+      // MAP_HUGETLB, which needs path on hugetlbfs, or else transparent huge
+      // pages through madvise where the filesystem supports them.
+      mapped_resource(const char* path, bool keep = false, bool huge = false, std::pmr::memory_resource* upstream = std::pmr::get_default_resource()) :
+         _keep(keep), _huge(huge), _upstream(upstream) {
+         _fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+         if (_fd >= 0 and !keep)
+            unlink(path);
+      }
+
+      mapped_resource(const mapped_resource&) = delete;
+      mapped_resource& operator=(const mapped_resource&) = delete;
+
+      inline bool is_open() const {
+         return _fd >= 0;
+      }
+
+      inline size_t mapped_length(size_t bytes) const {
+         size_t page = _huge ? huge_page : sysconf(_SC_PAGESIZE);
+         return (bytes + page - 1) / page * page;
+      }
+
+      ~mapped_resource() {
+         for (auto &[p, m] : _maps)
+            munmap(p, m.second);
+         if (_fd >= 0)
+            close(_fd);
+      }
+
+   protected:
+
+      void* do_allocate(size_t bytes, size_t alignment) override {
+         if (bytes < threshold)
+            return _upstream->allocate(bytes, alignment);
+         if (_fd < 0)
+            throw std::bad_alloc();
+
+         const size_t length = mapped_length(bytes);
+         const off_t offset = _size;
+         if (ftruncate(_fd, offset + length))
+            throw std::bad_alloc();
+
+         void* p = MAP_FAILED;
+         if (_huge)
+            p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_HUGETLB, _fd, offset);
+         if (p == MAP_FAILED)
+            p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, offset);
+         if (p == MAP_FAILED)
+            throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+         if (_huge)
+            madvise(p, length, MADV_HUGEPAGE);
+#endif
+         if (advice != MADV_NORMAL)
+            madvise(p, length, advice);
+
+         _size += length;
+         _maps[p] = {offset, length};
+         return p;
+      }
+
+      void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+         auto it = _maps.find(p);
+         if (it == _maps.end()) {
+            _upstream->deallocate(p, bytes, alignment);
+            return;
+         }
+         auto [offset, length] = it->second;
+         munmap(p, length);
+#ifdef FALLOC_FL_PUNCH_HOLE
+         if (!_keep)
+            fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+#endif
+         _maps.erase(it);
+      }
+
+      bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+         return this == &other;
+      }
+   };
+}
+
+#endif
@@ -1,47 +1,270 @@
-
 #ifndef MOVIE_HPP
 #define MOVIE_HPP
 
 #include <format.hpp>
 #include <frame.hpp>
 #include <pixel.hpp>
+#include <timer.hpp>
 
+#include <condition_variable>
+#include <cstring>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <png.h>
 #include <stdlib.h>
 #include <string>
+#include <thread>
+#include <vector>
+#include <type_traits>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <iostream>
 
 namespace im {
 
-   template<unsigned width, unsigned height, unsigned fps = 60, unsigned quality = 5>
-   struct movie {
+   // Raw RGB frames piped into an ffmpeg process.
+   struct ffmpeg_pipe {
 
-      frame<width, height> _frame;
       FILE *_movie;
 
-      movie(std::string filename) {
-         std::cout << string_format("ffmpeg -y -f rawvideo -vcodec rawvideo -pix_fmt rgb%u -s %ux%u -r %u -i - -f mp4 -q:v %u -an -vcodec mpeg4 %s", sizeof(png_byte)*24, width, height, fps, quality, filename) << std::endl;
-         _movie = popen(string_format("ffmpeg -y -f rawvideo -vcodec rawvideo -pix_fmt rgb%u -s %ux%u -r %u -i - -f mp4 -q:v %u -an -vcodec mpeg4 %s", sizeof(png_byte)*24, width, height, fps, quality, filename.c_str()).c_str(), "w");
+      ffmpeg_pipe(const std::string &filename, unsigned w, unsigned h, unsigned fps, unsigned quality) {
+         std::string cmd = string_format("ffmpeg -y -f rawvideo -vcodec rawvideo -pix_fmt rgb%u -s %ux%u -r %u -i - -f mp4 -q:v %u -an -vcodec mpeg4 %s", unsigned(sizeof(png_byte)*24), w, h, fps, quality, filename.c_str());
+         std::cout << cmd << std::endl;
+         _movie = popen(cmd.c_str(), "w");
+         if (!_movie)
+            return;
+#ifdef F_SETPIPE_SZ
+         // A pipe buffer of up to a whole frame lets ffmpeg drain while we
+         // write. Unprivileged processes are capped at pipe-max-size; if even
+         // that is refused the default buffer only costs speed.
+         long size = long(w)*h*sizeof(pixel);
+         FILE* limit = fopen("/proc/sys/fs/pipe-max-size", "r");
+         if (limit) {
+            long max;
+            if (fscanf(limit, "%ld", &max) == 1 and max < size)
+               size = max;
+            fclose(limit);
+         }
+         (void)fcntl(fileno(_movie), F_SETPIPE_SZ, int(size));
+#endif
+      }
+
+      // Whole frames go out in as few write(2) calls as the pipe allows,
+      // bypassing stdio buffering. Returns 1 if ffmpeg could not be started
+      // or stopped reading, with the frame lost.
+      template<typename F>
+      inline int write(F &f) {
+         if (!_movie)
+            return 1;
+         const char* data = (const char*)f._pixels;
+         size_t left = f.get_width()*f.get_height()*sizeof(pixel);
+         int fd = fileno(_movie);
+         while (left > 0) {
+            ssize_t n = ::write(fd, data, left);
+            if (n < 0 and errno == EINTR)
+               continue;
+            if (n <= 0)
+               return 1;
+            data += n;
+            left -= n;
+         }
+         return 0;
+      }
+
+      ~ffmpeg_pipe() {
+         if (_movie)
+            pclose(_movie);
+      }
+   };
+
+   struct movie_stats {
+      size_t frames = 0;
+      // Time write_frame spent waiting for a free buffer.
+      double stall_time = 0;
+      // Time the writer thread spent in the sink.
+      double write_time = 0;
+      // Frames the sink reported it could not write.
+      size_t failed = 0;
+      // Frames queued for the writer, sampled at each write_frame.
+      size_t max_queue = 0;
+      size_t total_queue = 0;
+
+      inline double mean_queue() const {
+         return frames ? double(total_queue) / frames : 0;
+      }
+   };
+
+   // Frames are painted into a ring of buffers and handed to the sink on a
+   // writer thread, so painting frame k+1 overlaps writing frame k. The ring,
+   // the sink and the writer live on the heap, so a movie moves without
+   // disturbing the thread writing it; a moved-from movie is empty.
+   template<unsigned width = dynamic, unsigned height = dynamic, unsigned fps = 60, unsigned quality = 5, size_t buffers = 2, typename sink = ffmpeg_pipe>
+   struct movie {
+
+      static_assert(buffers >= 2);
+
+      struct pipeline {
+         std::vector<frame<width, height>> _ring;
+         // Frames [_tail, _head) of the ring are queued for the writer; _head
+         // is the one being painted.
+         size_t _head = 0;
+         size_t _tail = 0;
+         size_t _queued = 0;
+         // Per buffer: the area changed in its frame, handed to the sink, and
+         // the area that changed in later frames, which it is missing.
+         std::vector<region> _changed;
+         std::vector<region> _stale;
+         bool _done = false;
+         std::mutex _lock;
+         std::condition_variable _ready;
+         std::condition_variable _free;
+         sink _sink;
+         std::thread _writer;
+         movie_stats stats;
+
+         pipeline(const std::string &filename, unsigned w, unsigned h) : _changed(buffers), _stale(buffers), _sink(filename, w, h, fps, quality) {
+            _ring.reserve(buffers);
+            for (size_t k = 0; k < buffers; k++)
+               _ring.emplace_back(w, h);
+            for (auto &r : _stale)
+               r = whole();
+            _writer = std::thread([this]() { drain(); });
+         }
+
+         inline region whole() {
+            region r;
+            r.x1 = _ring[0].get_width();
+            r.y1 = _ring[0].get_height();
+            return r;
+         }
+
+         inline void submit(const region &changed) {
+            for (size_t k = 0; k < buffers; k++)
+               if (k != _head)
+                  _stale[k].add(changed);
+            _stale[_head] = region();
+            _changed[_head] = changed;
+
+            std::unique_lock<std::mutex> guard(_lock);
+            _queued++;
+            _head = (_head + 1) % buffers;
+            stats.frames++;
+            stats.total_queue += _queued;
+            if (_queued > stats.max_queue)
+               stats.max_queue = _queued;
+            _ready.notify_one();
+
+            timer t;
+            _free.wait(guard, [this]() { return _queued < buffers; });
+            stats.stall_time += t.get_time();
+         }
+
+         // Hands f, and changed if the sink takes it, to the sink. Returns the
+         // sink's error code, or 0 for sinks that return none.
+         template<typename... R>
+         inline int write(frame<width, height> &f, const R&... changed) {
+            if constexpr (std::is_same_v<decltype(_sink.write(f, changed...)), void>) {
+               _sink.write(f, changed...);
+               return 0;
+            }
+            else {
+               return _sink.write(f, changed...);
+            }
+         }
+
+         void drain() {
+            // A sink whose reader has gone, such as a dead ffmpeg, then gets
+            // EPIPE on this thread instead of SIGPIPE killing the process.
+            sigset_t pipe;
+            sigemptyset(&pipe);
+            sigaddset(&pipe, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &pipe, NULL);
+
+            std::unique_lock<std::mutex> guard(_lock);
+            while (true) {
+               _ready.wait(guard, [this]() { return _queued > 0 or _done; });
+               if (_queued == 0)
+                  return;
+               frame<width, height> &f = _ring[_tail];
+               const region &changed = _changed[_tail];
+               guard.unlock();
+
+               timer t;
+               int err = 0;
+               if constexpr (requires { _sink.write(f, changed); })
+                  err = write(f, changed);
+               else
+                  err = write(f);
+               double dt = t.get_time();
+
+               guard.lock();
+               stats.write_time += dt;
+               if (err)
+                  stats.failed++;
+               _tail = (_tail + 1) % buffers;
+               _queued--;
+               _free.notify_one();
+            }
+         }
+
+         ~pipeline() {
+            {
+               std::lock_guard<std::mutex> guard(_lock);
+               _done = true;
+            }
+            _ready.notify_one();
+            _writer.join();
+         }
+      };
+
+      std::unique_ptr<pipeline> _pipeline;
+
+      movie(std::string filename, unsigned w = width, unsigned h = height) : _pipeline(std::make_unique<pipeline>(filename, w, h)) { }
+
+      movie(movie&&) noexcept = default;
+      movie& operator=(movie&&) noexcept = default;
+
+      // The buffer the next frame is painted into.
+      inline frame<width, height>& current() {
+         return _pipeline->_ring[_pipeline->_head];
+      }
+
+      // A snapshot of the statistics, which the writer thread keeps updating.
+      inline movie_stats stats() const {
+         std::lock_guard<std::mutex> guard(_pipeline->_lock);
+         return _pipeline->stats;
       }
 
       inline void write_frame() {
-         fwrite(_frame._pixels, sizeof(png_byte), height*width*3, _movie);
+         _pipeline->submit(_pipeline->whole());
       }
 
       template<typename painter>
       inline void write_frame(painter &p) {
-         _frame.paint(p);
+         current().paint(p);
          write_frame();
       }
 
-      ~movie() {
-         fflush(_movie);
-         pclose(_movie);
+      // Writes the frame of p, which differs from the previous one only
+      // within changed, e.g. a canvas and its dirty_region(). Only the part of
+      // the buffer that is out of date is copied from p, and the sink is told
+      // where to look for changes.
+      template<row_painter painter>
+      inline void write_frame(painter &p, const region &changed) {
+         region r = _pipeline->_stale[_pipeline->_head];
+         r.add(changed);
+         frame<width, height> &f = current();
+         if (!r.empty())
+            for (unsigned y = r.y0; y < r.y1; y++)
+               std::memcpy(f.row(y) + r.x0, p.row(y) + r.x0, (r.x1 - r.x0)*sizeof(pixel));
+         _pipeline->submit(changed);
       }
    };
 }
 
 #endif
-
@@ -0,0 +1,119 @@
+#ifndef PAGES_HPP
+#define PAGES_HPP
+
+#include <algorithm>
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <omp.h>
+
+namespace im {
+
+   // Memory resource for large frames. Allocations of at least threshold
+   // bytes are mapped anonymously on huge pages where the system has them:
+   // 1 GB pages when every thread's share of the block is a gigabyte or
+   // more, then 2 MB pages from the hugetlb pool, then transparent huge
+   // pages. Each block is then first touched in parallel, its bytes split
+   // evenly and in order over the threads like the rows of frame::paint's
+   // schedule(static), so on NUMA machines every thread's rows are placed on
+   // its own node, up to the page straddling each boundary. Smaller
+   // allocations come from upstream. Not thread-safe.
+   struct huge_page_resource : std::pmr::memory_resource {
+
+      static constexpr size_t huge_page = size_t(1) << 21;
+      static constexpr size_t giant_page = size_t(1) << 30;
+
+      std::map<void*, size_t> _maps;
+      std::pmr::memory_resource* _upstream;
+
+      size_t threshold = size_t(1) << 24;
+
+      huge_page_resource(std::pmr::memory_resource* upstream = std::pmr::get_default_resource()) : _upstream(upstream) { }
+
+      huge_page_resource(const huge_page_resource&) = delete;
+      huge_page_resource& operator=(const huge_page_resource&) = delete;
+
+      ~huge_page_resource() {
+         for (auto &[p, length] : _maps)
+            munmap(p, length);
+      }
+
+      static inline void* map(size_t length, int flags) {
+         return mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+      }
+
+      // Writes one byte of every page of the first bytes bytes at p, each
+      // page by the thread whose even share of the bytes it starts in.
+      static inline void first_touch(void* p, size_t bytes, size_t page) {
+         volatile char* c = (volatile char*)p;
+         #pragma omp parallel
+         {
+            const size_t threads = omp_get_num_threads();
+            const size_t t = omp_get_thread_num();
+            const size_t lo = bytes / threads * t + std::min(t, bytes % threads);
+            const size_t hi = lo + bytes / threads + (t < bytes % threads);
+            for (size_t k = (lo + page - 1) / page * page; k < hi; k += page)
+               c[k] = 0;
+         }
+      }
+
+   protected:
+
+      void* do_allocate(size_t bytes, size_t alignment) override {
+         if (bytes < threshold)
+            return _upstream->allocate(bytes, alignment);
+
+         size_t length = (bytes + huge_page - 1) / huge_page * huge_page;
+         size_t page = huge_page;
+         void* p = MAP_FAILED;
+#ifdef MAP_HUGE_1GB
+         // A giant page lands whole on one node, so it only pays when no
+         // thread's share is smaller.
+         if (bytes / omp_get_max_threads() >= giant_page) {
+            size_t giant = (bytes + giant_page - 1) / giant_page * giant_page;
+            p = map(giant, MAP_HUGETLB | MAP_HUGE_1GB);
+            if (p != MAP_FAILED) {
+               length = giant;
+               page = giant_page;
+            }
+         }
+#endif
+         if (p == MAP_FAILED)
+            p = map(length, MAP_HUGETLB);
+         if (p == MAP_FAILED) {
+            p = map(length, 0);
+            if (p == MAP_FAILED)
+               throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+            madvise(p, length, MADV_HUGEPAGE);
+#endif
+            // Transparent huge pages may fall back to small ones.
+            page = sysconf(_SC_PAGESIZE);
+         }
+
+         first_touch(p, bytes, page);
+         _maps[p] = length;
+         return p;
+      }
+
+      void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+         auto it = _maps.find(p);
+         if (it == _maps.end()) {
+            _upstream->deallocate(p, bytes, alignment);
+            return;
+         }
+         munmap(p, it->second);
+         _maps.erase(it);
+      }
+
+      bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+         return this == &other;
+      }
+   };
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef PATTERN_HPP
+#define PATTERN_HPP
+
+#include <atlas.hpp>
+#include <frame.hpp>
+#include <pixel.hpp>
+
+#include <cstring>
+#include <stdlib.h>
+
+namespace im {
+
+   // Painter for an image tiled from an atlas. Pixel (x, y) is pixel
+   // (x % tile width, y % tile height) of the tile keyed by grid.key(i, j)
+   // for tile column i = x / tile width and row j = y / tile height. The
+   // painter holds only the grid and the distinct tiles, so an image of any
+   // size can be painted, written or downsampled from it without ever
+   // existing whole. Every key reached must already be rendered.
+   template<typename grid, unsigned tile_w = dynamic, unsigned tile_h = dynamic>
+   struct pattern_painter {
+
+      const grid &_grid;
+      atlas<tile_w, tile_h> &_tiles;
+      size_t _width, _height;
+
+      pattern_painter(const grid &g, atlas<tile_w, tile_h> &tiles, size_t width, size_t height) : _grid(g), _tiles(tiles), _width(width), _height(height) { }
+
+      inline pixel paint(unsigned x, unsigned y) {
+         const unsigned tw = _tiles._width;
+         const unsigned th = _tiles._height;
+         return _tiles[_grid.key(x / tw, y / th)].paint(x % tw, y % th);
+      }
+
+      // Copies pixels [x, x + n) of row y to out, one memcpy per tile. This
+      // makes the painter a span_painter: frames, the PNG writers and the
+      // downsampler copy whole scanlines through it.
+      inline void span(unsigned x, unsigned y, unsigned n, pixel* out) {
+         const unsigned tw = _tiles._width;
+         const unsigned th = _tiles._height;
+         while (n > 0) {
+            const unsigned tx = x % tw;
+            const unsigned k = tw - tx < n ? tw - tx : n;
+            std::memcpy(out, _tiles[_grid.key(x / tw, y / th)].row(y % th) + tx, k*sizeof(pixel));
+            out += k;
+            x += k;
+            n -= k;
+         }
+      }
+
+      inline size_t get_width() const {
+         return _width;
+      }
+
+      inline size_t get_height() const {
+         return _height;
+      }
+   };
+}
+
+#endif
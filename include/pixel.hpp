@@ -13,11 +13,11 @@ namespace im {
       pixel() {}
       pixel(png_byte r, png_byte g, png_byte b) : r(r), g(g), b(b) {}
 
-      bool operator==(const im::pixel &other) {
+      bool operator==(const im::pixel &other) const {
          return r == other.r and g == other.g and b == other.b;
       }
 
-      bool operator!=(const im::pixel &other) {
+      bool operator!=(const im::pixel &other) const {
          return !(*this == other);
       }
    };
@@ -0,0 +1,217 @@
+#ifndef PNGZ_HPP
+#define PNGZ_HPP
+
+#include <pixel.hpp>
+
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <png.h>
+#include <zlib.h>
+
+namespace im {
+
+   // Raw deflate data for a run of filtered scanlines. Every zband ends on a
+   // full flush (byte aligned, no back references out of the band), so bands
+   // compressed independently can be concatenated into one zlib stream.
+   struct zband {
+      std::vector<png_byte> data;
+      uLong adler = 1;
+      uLong length = 0;
+   };
+
+   // Rows filtered with Up against the previous row, or with Sub when there is
+   // no previous row, so a band never depends on rows outside of it.
+   inline void filter_row(const png_byte* row, const png_byte* prev, size_t rowbytes, unsigned bpp, png_byte* out) {
+      if (prev) {
+         out[0] = PNG_FILTER_VALUE_UP;
+         for (size_t i = 0; i < rowbytes; i++)
+            out[i+1] = row[i] - prev[i];
+      }
+      else {
+         out[0] = PNG_FILTER_VALUE_SUB;
+         for (size_t i = 0; i < bpp; i++)
+            out[i+1] = row[i];
+         for (size_t i = bpp; i < rowbytes; i++)
+            out[i+1] = row[i] - row[i-bpp];
+      }
+   }
+
+   inline zband deflate_rows(png_bytepp rows, unsigned n, png_bytep prev, size_t rowbytes, unsigned bpp, int level) {
+      zband band;
+      z_stream z = {};
+      deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+
+      std::vector<png_byte> line(rowbytes + 1);
+      band.data.resize(deflateBound(&z, n*line.size()) + 64);
+      z.next_out = band.data.data();
+      z.avail_out = band.data.size();
+
+      for (unsigned j = 0; j < n; j++) {
+         filter_row(rows[j], j ? rows[j-1] : prev, rowbytes, bpp, line.data());
+         band.adler = adler32(band.adler, line.data(), line.size());
+         band.length += line.size();
+
+         z.next_in = line.data();
+         z.avail_in = line.size();
+         int flush = j + 1 == n ? Z_FULL_FLUSH : Z_NO_FLUSH;
+         do {
+            if (z.avail_out == 0) {
+               size_t used = band.data.size();
+               band.data.resize(2*used);
+               z.next_out = band.data.data() + used;
+               z.avail_out = band.data.size() - used;
+            }
+            deflate(&z, flush);
+         } while (z.avail_in > 0 or z.avail_out == 0);
+      }
+
+      band.data.resize(z.total_out);
+      deflateEnd(&z);
+      return band;
+   }
+
+   // Rows per zband so that each band holds roughly 2 MB of scanline data.
+   inline unsigned zband_rows(size_t rowbytes) {
+      size_t rows = (size_t(1) << 21) / (rowbytes + 1);
+      return rows ? rows : 1;
+   }
+
+   // Writes a PNG whose image data is a sequence of zbands, emitted as IDAT
+   // chunks in order and wrapped in a single zlib stream.
+   struct png_zwriter {
+
+      FILE* f = NULL;
+      uLong adler = 1;
+      png_byte zheader[2];
+      bool started = false;
+      // Set once a write fails, e.g. on a full disk.
+      bool failed = false;
+
+      static inline void put32(png_byte* b, uLong v) {
+         b[0] = v >> 24;
+         b[1] = v >> 16;
+         b[2] = v >> 8;
+         b[3] = v;
+      }
+
+      inline void put(const void* data, size_t n) {
+         if (n and fwrite(data, 1, n, f) != n)
+            failed = true;
+      }
+
+      inline void write_chunk(const char* type, const png_byte* pre, size_t npre, const png_byte* data, size_t n) {
+         png_byte len[4];
+         put32(len, npre + n);
+         uLong crc = crc32(0, (const Bytef*)type, 4);
+         if (npre)
+            crc = crc32(crc, pre, npre);
+         if (n)
+            crc = crc32(crc, data, n);
+         png_byte tail[4];
+         put32(tail, crc);
+
+         put(len, 4);
+         put(type, 4);
+         put(pre, npre);
+         put(data, n);
+         put(tail, 4);
+      }
+
+      // The two byte zlib stream header deflate would write at level.
+      static inline void zlib_header(int level, png_byte (&h)[2]) {
+         unsigned flevel = level == Z_DEFAULT_COMPRESSION ? 2 : level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+         unsigned cmf = 0x78;
+         unsigned flg = flevel << 6;
+         flg += (31 - (cmf*256 + flg) % 31) % 31;
+         h[0] = cmf;
+         h[1] = flg;
+      }
+
+      // The 6 bytes ending a zlib stream whose data has checksum adler: an
+      // empty final fixed-Huffman block, then the Adler-32.
+      static inline void trailer(uLong adler, png_byte (&out)[6]) {
+         out[0] = 0x03;
+         out[1] = 0x00;
+         put32(out + 2, adler);
+      }
+
+      int open(const char* fname, unsigned width, unsigned height, int bit_depth, int color_type, int level = Z_DEFAULT_COMPRESSION, const std::vector<pixel>* palette = NULL) {
+         f = fopen(fname, "wb");
+         if (!f) {
+            return 3;
+         }
+
+         failed = false;
+         static const png_byte signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+         put(signature, 8);
+
+         png_byte ihdr[13];
+         put32(ihdr, width);
+         put32(ihdr + 4, height);
+         ihdr[8] = bit_depth;
+         ihdr[9] = color_type;
+         ihdr[10] = PNG_COMPRESSION_TYPE_DEFAULT;
+         ihdr[11] = PNG_FILTER_TYPE_DEFAULT;
+         ihdr[12] = PNG_INTERLACE_NONE;
+         write_chunk("IHDR", NULL, 0, ihdr, 13);
+         if (palette)
+            write_chunk("PLTE", NULL, 0, (const png_byte*)palette->data(), palette->size()*sizeof(pixel));
+
+         zlib_header(level, zheader);
+         started = false;
+         adler = 1;
+
+         return 0;
+      }
+
+      inline void write(const zband &band) {
+         if (band.data.empty())
+            return;
+         write_chunk("IDAT", zheader, started ? 0 : 2, band.data.data(), band.data.size());
+         started = true;
+         adler = adler32_combine(adler, band.adler, band.length);
+      }
+
+      int close() {
+         if (!f)
+            return 1;
+
+         png_byte end[6];
+         trailer(adler, end);
+         write_chunk("IDAT", zheader, started ? 0 : 2, end, 6);
+         return finish();
+      }
+
+      // Writes IEND and closes the file, for callers that emitted their own
+      // image data chunks. Returns 11 if any write, or flushing the file,
+      // failed.
+      int finish() {
+         if (!f)
+            return 1;
+
+         write_chunk("IEND", NULL, 0, NULL, 0);
+
+         if (fclose(f))
+            failed = true;
+         f = NULL;
+
+         return failed ? 11 : 0;
+      }
+
+      // Closes the file as it is, without ending the image data, so that a
+      // failed write cannot pass for a complete PNG. The caller removes it.
+      void abort() {
+         if (!f)
+            return;
+         fclose(f);
+         f = NULL;
+      }
+
+      ~png_zwriter() {
+         close();
+      }
+   };
+}
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef PYRAMID_HPP
+#define PYRAMID_HPP
+
+#include <downsample.hpp>
+#include <format.hpp>
+#include <frame.hpp>
+#include <pixel.hpp>
+#include <stream.hpp>
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+namespace im {
+
+   // Streaming Deep Zoom (DZI) writer. Rows of the full image are pushed top
+   // to bottom; every level of the pyramid keeps one row of tiles, writes it
+   // out as soon as it is complete and passes 2 x 2 box averaged rows on to
+   // the level below, so memory stays around two tile rows of the full
+   // width. Level k is ceil(size / 2^(top - k)) pixels, level 0 is 1 x 1,
+   // and tile (c, r) of level k goes to name_files/k/c_r.png.
+   struct dzi_writer {
+
+      struct level {
+         unsigned width, height;
+         // Rows [y, y + held) of the level, a row of tiles at most.
+         unsigned y = 0;
+         unsigned held = 0;
+         std::vector<pixel> rows;
+         // An even row waiting for its pair, and the halved pair.
+         std::vector<pixel> pending;
+         bool has_pending = false;
+         std::vector<pixel> half;
+      };
+
+      std::string _files;
+      unsigned _tile;
+      std::vector<level> _levels;
+      int _err = 0;
+
+      int open(const char* name, unsigned width, unsigned height, unsigned tile = 256) {
+         _tile = tile;
+         _files = std::string(name) + "_files";
+
+         FILE* f = fopen((std::string(name) + ".dzi").c_str(), "w");
+         if (!f) {
+            return 3;
+         }
+         fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+         fprintf(f, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"png\" Overlap=\"0\" TileSize=\"%u\">\n", tile);
+         fprintf(f, "   <Size Width=\"%u\" Height=\"%u\"/>\n", width, height);
+         fprintf(f, "</Image>\n");
+         fclose(f);
+
+         unsigned top = 0;
+         while ((size_t(1) << top) < width or (size_t(1) << top) < height)
+            top++;
+         _levels.resize(top + 1);
+         mkdir(_files.c_str(), 0755);
+         for (unsigned k = 0; k <= top; k++) {
+            level &l = _levels[k];
+            l.width = ((size_t(width) << k) + (size_t(1) << top) - 1) >> top;
+            l.height = ((size_t(height) << k) + (size_t(1) << top) - 1) >> top;
+            l.rows.resize(size_t(tile)*l.width);
+            if (k > 0) {
+               l.pending.resize(l.width);
+               l.half.resize((l.width + 1) / 2);
+            }
+            mkdir(string_format("%s/%u", _files.c_str(), k).c_str(), 0755);
+         }
+         return 0;
+      }
+
+      // Writes the held row of tiles of level k, one tile per thread.
+      void flush(unsigned k) {
+         level &l = _levels[k];
+         const unsigned r = l.y / _tile;
+         const unsigned cols = (l.width + _tile - 1) / _tile;
+         #pragma omp parallel for schedule(dynamic)
+         for (int c = 0; c < cols; c++) {
+            unsigned x = c*_tile;
+            unsigned tw = l.width - x < _tile ? l.width - x : _tile;
+            png_stream out;
+            int err = out.open(string_format("%s/%u/%u_%u.png", _files.c_str(), k, c, r).c_str(), tw, l.held);
+            if (err) {
+               #pragma omp atomic write
+               _err = err;
+               continue;
+            }
+            for (unsigned j = 0; j < l.held; j++)
+               out.write_row(&l.rows[size_t(j)*l.width + x]);
+            err = out.close();
+            if (err) {
+               #pragma omp atomic write
+               _err = err;
+            }
+         }
+         l.y += l.held;
+         l.held = 0;
+      }
+
+      // Appends the next row of level k.
+      void push(unsigned k, const pixel* row) {
+         level &l = _levels[k];
+         std::memcpy(&l.rows[size_t(l.held)*l.width], row, l.width*sizeof(pixel));
+         l.held++;
+         const unsigned seen = l.y + l.held;
+
+         if (k > 0) {
+            if (l.has_pending) {
+               halve_rows(l.pending.data(), row, l.width, l.half.data());
+               l.has_pending = false;
+               push(k-1, l.half.data());
+            }
+            else if (seen == l.height) {
+               halve_rows(row, row, l.width, l.half.data());
+               push(k-1, l.half.data());
+            }
+            else {
+               std::memcpy(l.pending.data(), row, l.width*sizeof(pixel));
+               l.has_pending = true;
+            }
+         }
+
+         if (l.held == _tile or seen == l.height)
+            flush(k);
+      }
+
+      inline void write_rows(pixel** rows, unsigned n) {
+         for (unsigned j = 0; j < n; j++)
+            push(_levels.size() - 1, rows[j]);
+      }
+
+      // Returns the first error met writing a tile, or 1 if rows are missing.
+      int close() {
+         if (_err)
+            return _err;
+         for (auto &l : _levels)
+            if (l.y != l.height)
+               return 1;
+         return 0;
+      }
+   };
+
+   // Writes a width x height image as the Deep Zoom pyramid name.dzi, filled
+   // a band at a time by fill(y, rows, b) as for write_bands_parallel: one
+   // band per thread is filled in parallel, then the batch is pushed in
+   // order.
+   template<typename filler>
+   int write_bands_dzi(const char* name, unsigned width, unsigned height, unsigned band, filler &fill, unsigned tile = 256) {
+      dzi_writer out;
+      int err = out.open(name, width, height, tile);
+      if (err)
+         return err;
+
+      const unsigned batch = omp_get_max_threads();
+      std::vector<frame<>> bs;
+      bs.reserve(batch);
+      for (unsigned k = 0; k < batch; k++)
+         bs.emplace_back(width, band);
+      std::vector<unsigned> rows(batch);
+
+      for (unsigned y = 0; y < height; y += batch*band) {
+         unsigned nb = 0;
+         for (; nb < batch and y + nb*band < height; nb++) {
+            unsigned by = y + nb*band;
+            rows[nb] = height - by < band ? height - by : band;
+         }
+
+         #pragma omp parallel for schedule(dynamic)
+         for (int k = 0; k < nb; k++)
+            fill(y + k*band, rows[k], bs[k]);
+
+         for (unsigned k = 0; k < nb; k++)
+            out.write_rows(bs[k]._pixel_rows, rows[k]);
+      }
+
+      return out.close();
+   }
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef RASTER_HPP
+#define RASTER_HPP
+
+#include <pixel.hpp>
+
+#include <cstring>
+#include <stdlib.h>
+
+namespace im {
+
+   // Fills pixels [x0, x1) of row with c. The run is grown by doubling
+   // memcpys, so long runs are written with wide moves.
+   inline void fill_span(pixel* row, int x0, int x1, pixel c) {
+      if (x1 <= x0)
+         return;
+      pixel* p = row + x0;
+      size_t n = x1 - x0;
+      p[0] = c;
+      for (size_t done = 1; done < n;) {
+         size_t k = done < n - done ? done : n - done;
+         std::memcpy(p + done, p, k*sizeof(pixel));
+         done += k;
+      }
+   }
+
+   // Shapes cover rows [y0, y1); span(y, xa, xb) gives the covered columns
+   // [xa, xb) of row y, or returns false if the row is empty. Shapes are
+   // placed in an oriented frame: local (u, v) is pixel (ix + u*dx, iy + v*dy)
+   // with dx, dy each +1 or -1.
+
+   // The a x b rectangle u in [0, a), v in [0, b).
+   struct rect {
+      int x0, x1, y0, y1;
+
+      rect(int ix, int iy, int dx, int dy, int a, int b) {
+         x0 = dx > 0 ? ix : ix - a + 1;
+         x1 = x0 + a;
+         y0 = dy > 0 ? iy : iy - b + 1;
+         y1 = y0 + b;
+      }
+
+      inline bool span(int y, int &xa, int &xb) const {
+         xa = x0;
+         xb = x1;
+         return true;
+      }
+   };
+
+   // Rows v = v0 + t*dv for t in [0, count), row t covering u in
+   // [u0 + t*du0, u1 + t*du1]. With unit slopes this gives the right
+   // triangles, trapezoids and parallelograms of 45 degree geometry.
+   struct stair {
+      int ix, iy, dx, dy;
+      int v0, dv, count;
+      int u0, du0, u1, du1;
+      int y0, y1;
+
+      stair(int ix, int iy, int dx, int dy, int v0, int dv, int count, int u0, int du0, int u1, int du1) :
+         ix(ix), iy(iy), dx(dx), dy(dy), v0(v0), dv(dv), count(count), u0(u0), du0(du0), u1(u1), du1(du1) {
+         if (count <= 0) {
+            y0 = y1 = 0;
+            return;
+         }
+         int ya = iy + v0*dy;
+         int yb = iy + (v0 + (count-1)*dv)*dy;
+         y0 = ya < yb ? ya : yb;
+         y1 = (ya < yb ? yb : ya) + 1;
+      }
+
+      inline bool span(int y, int &xa, int &xb) const {
+         int t = ((y - iy)*dy - v0)*dv;
+         if (t < 0 or t >= count)
+            return false;
+         int ua = u0 + t*du0;
+         int ub = u1 + t*du1;
+         if (ub < ua)
+            return false;
+         xa = dx > 0 ? ix + ua : ix - ub;
+         xb = dx > 0 ? ix + ub + 1 : ix - ua + 1;
+         return true;
+      }
+   };
+
+   // The w x w square u, v in [0, w) stamped at every offset i*(sx, sy) in
+   // image coordinates, for i in [0, steps]. Straight sweeps are rectangles,
+   // diagonal ones are 45 degree hexagons.
+   struct sweep {
+      int ix, iy, dx, dy;
+      int w, sx, sy, steps;
+      int y0, y1;
+
+      static inline int min(int a, int b) {
+         return a < b ? a : b;
+      }
+
+      static inline int max(int a, int b) {
+         return a < b ? b : a;
+      }
+
+      sweep(int ix, int iy, int dx, int dy, int w, int sx, int sy, int steps) :
+         ix(ix), iy(iy), dx(dx), dy(dy), w(w), sx(sx), sy(sy), steps(steps) {
+         y0 = iy + min(0, steps*sy) + min(0, (w-1)*dy);
+         y1 = iy + max(0, steps*sy) + max(0, (w-1)*dy) + 1;
+      }
+
+      inline bool span(int y, int &xa, int &xb) const {
+         int ilo = 0;
+         int ihi = steps;
+         if (sy != 0) {
+            // i*sy = y - iy - v*dy for some v in [0, w)
+            int lo = min(y - iy, y - iy - (w-1)*dy);
+            int hi = max(y - iy, y - iy - (w-1)*dy);
+            ilo = max(0, sy > 0 ? lo : -hi);
+            ihi = min(steps, sy > 0 ? hi : -lo);
+            if (ihi < ilo)
+               return false;
+         }
+         xa = ix + min(ilo*sx, ihi*sx) + min(0, (w-1)*dx);
+         xb = ix + max(ilo*sx, ihi*sx) + max(0, (w-1)*dx) + 1;
+         return true;
+      }
+   };
+
+   // Scanline filler: writes every pixel of shape s exactly once. Parts of
+   // the shape outside f are clipped.
+   template<typename F, typename shape>
+   inline void fill(F &f, const shape &s, pixel c) {
+      const int w = f.get_width();
+      const int h = f.get_height();
+      int xa, xb;
+      for (int y = s.y0 > 0 ? s.y0 : 0; y < s.y1 and y < h; y++)
+         if (s.span(y, xa, xb))
+            fill_span(f.row(y), xa > 0 ? xa : 0, xb < w ? xb : w, c);
+   }
+}
+
+#endif
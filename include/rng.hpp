@@ -0,0 +1,196 @@
+#ifndef RNG_HPP
+#define RNG_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// splitmix64 output function, a strong 64-bit mixer.
+static inline uint64_t mix64(uint64_t z) {
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+   return z ^ (z >> 31);
+}
+
+static inline uint64_t splitmix64(uint64_t &x) {
+   return mix64(x += 0x9e3779b97f4a7c15);
+}
+
+static inline uint64_t rotl(const uint64_t x, int k) {
+   return (x << k) | (x >> (64 - k));
+}
+
+// Unbiased integer in [0, n) from any generator with next(), using
+// Lemire's multiply-and-reject method.
+template<typename rng>
+inline uint64_t bounded(rng &g, uint64_t n) {
+   __uint128_t m = (__uint128_t)g.next() * n;
+   uint64_t l = (uint64_t)m;
+   if (l < n) {
+      uint64_t t = -n % n;
+      while (l < t) {
+         m = (__uint128_t)g.next() * n;
+         l = (uint64_t)m;
+      }
+   }
+   return m >> 64;
+}
+
+/* This is xoshiro256++ 1.0, one of our all-purpose, rock-solid generators.
+   It has excellent (sub-ns) speed, a state (256 bits) that is large
+   enough for any parallel application, and it passes all tests we are
+   aware of.
+
+   For generating just floating-point numbers, xoshiro256+ is even faster.
+
+   The state must be seeded so that it is not everywhere zero. If you have
+   a 64-bit seed, we suggest to seed a splitmix64 generator and use its
+   output to fill s. */
+struct xoshiro256pp {
+
+   uint64_t s[4];
+
+   xoshiro256pp(uint64_t seed) {
+      for (int i = 0; i < 4; i++)
+         s[i] = splitmix64(seed);
+   }
+
+   inline uint64_t next() {
+      const uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+
+      const uint64_t t = s[1] << 17;
+
+      s[2] ^= s[0];
+      s[3] ^= s[1];
+      s[1] ^= s[2];
+      s[0] ^= s[3];
+
+      s[2] ^= t;
+
+      s[3] = rotl(s[3], 45);
+
+      return result;
+   }
+
+   inline uint64_t bounded(uint64_t n) {
+      return ::bounded(*this, n);
+   }
+
+   /* This is the jump function for the generator. It is equivalent
+      to 2^128 calls to next(); it can be used to generate 2^128
+      non-overlapping subsequences for parallel computations. */
+   void jump() {
+      static const uint64_t JUMP[] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c };
+      advance(JUMP);
+   }
+
+   /* This is the long-jump function for the generator. It is equivalent to
+      2^192 calls to next(); it can be used to generate 2^64 starting points,
+      from each of which jump() will generate 2^64 non-overlapping
+      subsequences for parallel distributed computations. */
+   void long_jump() {
+      static const uint64_t LONG_JUMP[] = { 0x76e15d3efefdcbbf, 0xc5004e441c522fb3, 0x77710069854ee241, 0x39109bb02acbe635 };
+      advance(LONG_JUMP);
+   }
+
+   // Independent stream k: this generator advanced by k jumps.
+   xoshiro256pp stream(size_t k) const {
+      xoshiro256pp g = *this;
+      for (size_t i = 0; i < k; i++)
+         g.jump();
+      return g;
+   }
+
+private:
+
+   void advance(const uint64_t (&poly)[4]) {
+      uint64_t s0 = 0;
+      uint64_t s1 = 0;
+      uint64_t s2 = 0;
+      uint64_t s3 = 0;
+      for (int i = 0; i < 4; i++)
+         for (int b = 0; b < 64; b++) {
+            if (poly[i] & uint64_t(1) << b) {
+               s0 ^= s[0];
+               s1 ^= s[1];
+               s2 ^= s[2];
+               s3 ^= s[3];
+            }
+            next();
+         }
+
+      s[0] = s0;
+      s[1] = s1;
+      s[2] = s2;
+      s[3] = s3;
+   }
+};
+
+// L xoshiro256++ streams, one jump apart, stepped in lockstep. The state is
+// laid out lane-major so the per-lane loops compile to vector instructions;
+// fill() writes the lanes' outputs interleaved.
+template<size_t L = 8>
+struct xoshiro256pp_lanes {
+
+   alignas(64) uint64_t s[4][L];
+
+   xoshiro256pp_lanes(xoshiro256pp g) {
+      for (size_t l = 0; l < L; l++) {
+         for (int i = 0; i < 4; i++)
+            s[i][l] = g.s[i];
+         g.jump();
+      }
+   }
+
+   inline void next(uint64_t (&out)[L]) {
+      for (size_t l = 0; l < L; l++) {
+         out[l] = rotl(s[0][l] + s[3][l], 23) + s[0][l];
+
+         const uint64_t t = s[1][l] << 17;
+
+         s[2][l] ^= s[0][l];
+         s[3][l] ^= s[1][l];
+         s[1][l] ^= s[2][l];
+         s[0][l] ^= s[3][l];
+
+         s[2][l] ^= t;
+
+         s[3][l] = rotl(s[3][l], 45);
+      }
+   }
+
+   void fill(uint64_t* out, size_t n) {
+      uint64_t block[L];
+      size_t i = 0;
+      for (; i + L <= n; i += L) {
+         next(*(uint64_t(*)[L])(out + i));
+      }
+      if (i < n) {
+         next(block);
+         for (size_t l = 0; i < n; l++, i++)
+            out[i] = block[l];
+      }
+   }
+};
+
+// Counter-based generator: the k-th number drawn for key (i, j) is a pure
+// function of (seed, i, j, k), so work keyed by (i, j) can run on any
+// thread in any order and still draw the same numbers.
+struct counter_rng {
+
+   uint64_t key;
+   uint64_t counter = 0;
+
+   counter_rng(uint64_t seed, uint64_t i, uint64_t j) {
+      key = mix64(mix64(seed ^ mix64(i + 0x9e3779b97f4a7c15)) ^ j);
+   }
+
+   inline uint64_t next() {
+      return mix64(key + ++counter * 0x9e3779b97f4a7c15);
+   }
+
+   inline uint64_t bounded(uint64_t n) {
+      return ::bounded(*this, n);
+   }
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef SCRATCH_HPP
+#define SCRATCH_HPP
+
+#include <map>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+#include <stdlib.h>
+
+namespace im {
+
+   // Memory resource that keeps freed blocks on free lists by size and
+   // alignment, and hands them back out for later requests of the same shape.
+   // Transient frames of a few recurring sizes, such as per-tile scratch
+   // images, stop reaching the heap once every size has been seen. Not
+   // thread-safe.
+   struct recycling_resource : std::pmr::memory_resource {
+
+      std::pmr::memory_resource* _upstream;
+      std::map<std::pair<size_t, size_t>, std::vector<void*>> _free;
+
+      recycling_resource(std::pmr::memory_resource* upstream = std::pmr::get_default_resource()) : _upstream(upstream) { }
+
+      recycling_resource(const recycling_resource&) = delete;
+      recycling_resource& operator=(const recycling_resource&) = delete;
+
+      // Returns every cached block to the upstream resource.
+      void release() {
+         for (auto &[shape, blocks] : _free)
+            for (void* p : blocks)
+               _upstream->deallocate(p, shape.first, shape.second);
+         _free.clear();
+      }
+
+      ~recycling_resource() {
+         release();
+      }
+
+   protected:
+
+      void* do_allocate(size_t bytes, size_t alignment) override {
+         auto it = _free.find({bytes, alignment});
+         if (it != _free.end() and !it->second.empty()) {
+            void* p = it->second.back();
+            it->second.pop_back();
+            return p;
+         }
+         return _upstream->allocate(bytes, alignment);
+      }
+
+      void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+         _free[{bytes, alignment}].push_back(p);
+      }
+
+      bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+         return this == &other;
+      }
+   };
+
+   // The calling thread's scratch pool. Frames allocated from it must be
+   // destroyed on the same thread.
+   inline recycling_resource* scratch_resource() {
+      thread_local recycling_resource pool;
+      return &pool;
+   }
+}
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef SHARD_HPP
+#define SHARD_HPP
+
+#include <pngz.hpp>
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <png.h>
+#include <zlib.h>
+
+namespace im {
+
+   // A shard file holds the zbands of rows [y0, y1) of a width x height RGB
+   // PNG, as made by deflate_bands, so that bands rendered by separate
+   // processes can be stitched into one PNG without recompressing. All
+   // integers are big-endian:
+   //
+   //    "ZSHD" width height y0 y1 level
+   //    then per zband: adler length(64) size(64) data[size]
+   struct shard_writer {
+
+      static constexpr char magic[4] = {'Z', 'S', 'H', 'D'};
+
+      FILE* f = NULL;
+      // Set once a write fails, e.g. on a full disk.
+      bool failed = false;
+
+      inline void put(const void* data, size_t n) {
+         if (fwrite(data, 1, n, f) != n)
+            failed = true;
+      }
+
+      inline void put32(uLong v) {
+         png_byte b[4];
+         png_zwriter::put32(b, v);
+         put(b, 4);
+      }
+
+      inline void put64(uint64_t v) {
+         put32(v >> 32);
+         put32(v & 0xffffffff);
+      }
+
+      int open(const char* fname, unsigned width, unsigned height, unsigned y0, unsigned y1, int level = Z_DEFAULT_COMPRESSION) {
+         f = fopen(fname, "wb");
+         if (!f) {
+            return 3;
+         }
+         failed = false;
+         put(magic, 4);
+         put32(width);
+         put32(height);
+         put32(y0);
+         put32(y1);
+         put32(uint32_t(level));
+         return 0;
+      }
+
+      inline void write(const zband &band) {
+         put32(band.adler);
+         put64(band.length);
+         put64(band.data.size());
+         put(band.data.data(), band.data.size());
+      }
+
+      // Returns 11 if any write, or flushing the file, failed.
+      int close() {
+         if (!f)
+            return 1;
+         if (fclose(f))
+            failed = true;
+         f = NULL;
+         return failed ? 11 : 0;
+      }
+
+      ~shard_writer() {
+         close();
+      }
+   };
+
+   struct shard_reader {
+
+      FILE* f = NULL;
+      unsigned width, height, y0, y1;
+      int level;
+      // Size of the file, which bounds the size of every zband in it.
+      long file_size = 0;
+
+      inline bool get32(uint32_t &v) {
+         png_byte b[4];
+         if (fread(b, 1, 4, f) != 4)
+            return false;
+         v = (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | b[3];
+         return true;
+      }
+
+      inline bool get64(uint64_t &v) {
+         uint32_t hi, lo;
+         if (!get32(hi) or !get32(lo))
+            return false;
+         v = (uint64_t(hi) << 32) | lo;
+         return true;
+      }
+
+      int open(const char* fname) {
+         f = fopen(fname, "rb");
+         if (!f) {
+            return 8;
+         }
+         if (fseek(f, 0, SEEK_END) or (file_size = ftell(f)) < 0 or fseek(f, 0, SEEK_SET))
+            return 9;
+         char m[4];
+         uint32_t l;
+         if (fread(m, 1, 4, f) != 4 or std::string(m, 4) != std::string(shard_writer::magic, 4))
+            return 9;
+         if (!get32(width) or !get32(height) or !get32(y0) or !get32(y1) or !get32(l))
+            return 9;
+         if (y0 > y1 or y1 > height)
+            return 9;
+         level = int32_t(l);
+         return 0;
+      }
+
+      // Reads the next zband. Returns 1 on success, 0 at the end of the
+      // shard and -1 if the shard is truncated or its size is corrupt.
+      inline int read(zband &band) {
+         int c = fgetc(f);
+         if (c == EOF)
+            return 0;
+         ungetc(c, f);
+
+         uint32_t adler;
+         uint64_t length, size;
+         if (!get32(adler) or !get64(length) or !get64(size))
+            return -1;
+         band.adler = adler;
+         band.length = length;
+         if (size > uint64_t(file_size - ftell(f)))
+            return -1;
+         band.data.resize(size);
+         return fread(band.data.data(), 1, size, f) == size ? 1 : -1;
+      }
+
+      ~shard_reader() {
+         if (f)
+            fclose(f);
+      }
+   };
+
+   // Concatenates shards, which must cover the image rows in order, into the
+   // PNG fname. Returns 8 if a shard cannot be opened, 9 if one is malformed,
+   // truncated or does not match the first, and 10 if the shards leave a gap
+   // or overlap; fname is then removed rather than left looking complete.
+   inline int stitch(const char* fname, const std::vector<std::string> &shards) {
+      if (shards.empty())
+         return 10;
+
+      shard_reader first;
+      int err = first.open(shards[0].c_str());
+      if (err)
+         return err;
+
+      png_zwriter out;
+      err = out.open(fname, first.width, first.height, 8, PNG_COLOR_TYPE_RGB, first.level);
+      if (err)
+         return err;
+      auto fail = [&](int err) {
+         out.abort();
+         remove(fname);
+         return err;
+      };
+
+      unsigned next = 0;
+      zband band;
+      for (auto &name : shards) {
+         shard_reader in;
+         err = in.open(name.c_str());
+         if (err)
+            return fail(err);
+         if (in.width != first.width or in.height != first.height or in.level != first.level)
+            return fail(9);
+         if (in.y0 != next)
+            return fail(10);
+         int r;
+         uint64_t length = 0;
+         while ((r = in.read(band)) > 0) {
+            out.write(band);
+            length += band.length;
+         }
+         if (r < 0)
+            return fail(9);
+         // A shard cut short, e.g. by a killed process, ends on a band
+         // boundary but holds fewer rows than its header claims.
+         if (length != uint64_t(in.y1 - in.y0)*(3*uint64_t(in.width) + 1))
+            return fail(9);
+         next = in.y1;
+      }
+      if (next != first.height)
+         return fail(10);
+
+      err = out.close();
+      if (err)
+         remove(fname);
+      return err;
+   }
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
+#include <frame.hpp>
+#include <pixel.hpp>
+#include <pngz.hpp>
+
+#include <vector>
+#include <stdlib.h>
+#include <png.h>
+#include <omp.h>
+
+namespace im {
+
+   // Incremental RGB PNG writer: rows are handed to libpng as they are
+   // produced, so the full image never has to be held in memory.
+   struct png_stream {
+
+      png_structp png_ptr = NULL;
+      png_infop info_ptr = NULL;
+      FILE* f = NULL;
+
+      int open(const char* fname, unsigned width, unsigned height) {
+         png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+         if (!png_ptr) {
+            return 1;
+         }
+
+         info_ptr = png_create_info_struct(png_ptr);
+         if (!info_ptr) {
+            png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+            return 2;
+         }
+
+         f = fopen(fname, "wb");
+         if (!f) {
+            png_destroy_write_struct(&png_ptr, &info_ptr);
+            return 3;
+         }
+
+         png_init_io(png_ptr, f);
+         png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+         png_write_info(png_ptr, info_ptr);
+
+         return 0;
+      }
+
+      inline void write_rows(pixel** rows, unsigned n) {
+         png_write_rows(png_ptr, (png_bytepp)rows, n);
+      }
+
+      inline void write_row(pixel* row) {
+         png_write_row(png_ptr, (png_bytep)row);
+      }
+
+      int close() {
+         if (!f)
+            return 1;
+         png_write_end(png_ptr, NULL);
+         png_destroy_write_struct(&png_ptr, &info_ptr);
+
+         // Buffered rows that cannot be flushed, e.g. on a full disk.
+         int err = fclose(f) ? 11 : 0;
+         f = NULL;
+
+         return err;
+      }
+
+      ~png_stream() {
+         close();
+      }
+   };
+
+   // Writes a width x height PNG one band of rows at a time. fill(y, rows, b)
+   // paints image rows [y, y + rows) into the first rows rows of the band
+   // frame b, a band_frame of width x band pixels.
+   template<typename band_frame, typename filler>
+   int write_band_frames(const char* fname, unsigned width, unsigned height, unsigned band, filler &fill) {
+      png_stream out;
+      int err = out.open(fname, width, height);
+      if (err)
+         return err;
+
+      band_frame b(width, band);
+      for (unsigned y = 0; y < height; y += band) {
+         unsigned rows = height - y < band ? height - y : band;
+         fill(y, rows, b);
+         out.write_rows(b._pixel_rows, rows);
+      }
+
+      return out.close();
+   }
+
+   // Fills and deflates the bands of rows [y0, y1) of a width x height image,
+   // one band per thread at a time, handing their zbands to emit in order.
+   // Filling and deflating each run in parallel, so fill is called
+   // concurrently for different bands. y0 must be a multiple of band; if it
+   // is not 0 the band above is filled too, so that the first band is
+   // filtered against the row above it and the zbands are exactly those of
+   // these rows in a whole-image pass.
+   template<typename band_frame, typename filler, typename emitter>
+   void deflate_band_frames(unsigned width, unsigned height, unsigned band, filler &fill, int level, unsigned y0, unsigned y1, emitter &emit) {
+      const size_t rowbytes = width*sizeof(pixel);
+      const unsigned batch = omp_get_max_threads();
+      std::vector<band_frame> bs;
+      bs.reserve(batch);
+      for (unsigned k = 0; k < batch; k++)
+         bs.emplace_back(width, band);
+      std::vector<unsigned> rows(batch);
+      std::vector<zband> zs(batch);
+      std::vector<pixel> last(width);
+
+      if (y0 > 0) {
+         fill(y0 - band, band, bs[0]);
+         std::memcpy(last.data(), bs[0]._pixel_rows[band-1], rowbytes);
+      }
+
+      for (unsigned y = y0; y < y1; y += batch*band) {
+         unsigned nb = 0;
+         for (; nb < batch and y + nb*band < y1; nb++) {
+            unsigned by = y + nb*band;
+            rows[nb] = y1 - by < band ? y1 - by : band;
+         }
+
+         #pragma omp parallel for schedule(dynamic)
+         for (int k = 0; k < nb; k++)
+            fill(y + k*band, rows[k], bs[k]);
+
+         #pragma omp parallel for schedule(dynamic)
+         for (int k = 0; k < nb; k++) {
+            png_bytep prev = k ? (png_bytep)bs[k-1]._pixel_rows[band-1] : y ? (png_bytep)last.data() : NULL;
+            zs[k] = deflate_rows((png_bytepp)bs[k]._pixel_rows, rows[k], prev, rowbytes, sizeof(pixel), level);
+         }
+
+         for (unsigned k = 0; k < nb; k++)
+            emit(zs[k]);
+         std::memcpy(last.data(), bs[nb-1]._pixel_rows[rows[nb-1]-1], rowbytes);
+      }
+   }
+
+   // Like write_band_frames, but bands are filled and deflated in parallel
+   // with deflate_band_frames.
+   template<typename band_frame, typename filler>
+   int write_band_frames_parallel(const char* fname, unsigned width, unsigned height, unsigned band, filler &fill, int level) {
+      png_zwriter out;
+      int err = out.open(fname, width, height, 8, PNG_COLOR_TYPE_RGB, level);
+      if (err)
+         return err;
+
+      auto emit = [&](const zband &z) {
+         out.write(z);
+      };
+      deflate_band_frames<band_frame>(width, height, band, fill, level, 0, height, emit);
+
+      return out.close();
+   }
+
+   // As above, also handing each band to tee.write_band(y, rows, n) right
+   // after it is filled, from the thread that filled it, e.g. a
+   // box_thumbnail of the image being written.
+   template<typename band_frame, typename filler, typename sink>
+   int write_band_frames_parallel(const char* fname, unsigned width, unsigned height, unsigned band, filler &fill, int level, sink &tee) {
+      auto fill_tee = [&](unsigned y, unsigned rows, band_frame &b) {
+         fill(y, rows, b);
+         tee.write_band(y, b._pixel_rows, rows);
+      };
+      return write_band_frames_parallel<band_frame>(fname, width, height, band, fill_tee, level);
+   }
+
+   template<typename band_frame, typename painter>
+   int write_painter_bands(const char* fname, unsigned width, unsigned height, unsigned band, painter &p) {
+      if constexpr (row_painter<painter>) {
+         png_stream out;
+         int err = out.open(fname, width, height);
+         if (err)
+            return err;
+         for (unsigned y = 0; y < height; y++)
+            out.write_row(p.row(y));
+         return out.close();
+      }
+      else if constexpr (span_painter<painter>) {
+         auto fill = [&](unsigned y, unsigned rows, band_frame &b) {
+            #pragma omp parallel for schedule(static)
+            for (int j = 0; j < rows; j++)
+               p.span(0, y + j, width, b._pixel_rows[j]);
+         };
+         return write_band_frames<band_frame>(fname, width, height, band, fill);
+      }
+      else {
+         auto fill = [&](unsigned y, unsigned rows, band_frame &b) {
+            #pragma omp parallel for schedule(guided)
+            for (int j = 0; j < rows; j++)
+               for (int i = 0; i < width; i++)
+                  b._pixel_rows[j][i] = p.paint(i, y + j);
+         };
+         return write_band_frames<band_frame>(fname, width, height, band, fill);
+      }
+   }
+
+   // Band writers for compile-time sizes; the band is a frame<width, band>.
+   template<unsigned width, unsigned height, unsigned band, typename filler>
+   int write_bands(const char* fname, filler &fill) {
+      return write_band_frames<frame<width, band>>(fname, width, height, band, fill);
+   }
+
+   template<unsigned width, unsigned height, unsigned band, typename filler>
+   int write_bands_parallel(const char* fname, filler &fill, int level = Z_DEFAULT_COMPRESSION) {
+      return write_band_frames_parallel<frame<width, band>>(fname, width, height, band, fill, level);
+   }
+
+   // Writes the width x height output of painter p, band rows at a time.
+   // Painters exposing contiguous rows are written without copying.
+   template<unsigned width, unsigned height, unsigned band = 64, typename painter>
+   int write_painter(const char* fname, painter &p) {
+      return write_painter_bands<frame<width, band>>(fname, width, height, band, p);
+   }
+
+   // Band writers for runtime sizes; the band is a frame<>.
+   template<typename filler>
+   int write_bands(const char* fname, unsigned width, unsigned height, unsigned band, filler &fill) {
+      return write_band_frames<frame<>>(fname, width, height, band, fill);
+   }
+
+   template<typename filler>
+   int write_bands_parallel(const char* fname, unsigned width, unsigned height, unsigned band, filler &fill, int level = Z_DEFAULT_COMPRESSION) {
+      return write_band_frames_parallel<frame<>>(fname, width, height, band, fill, level);
+   }
+
+   template<typename filler, typename sink>
+   int write_bands_parallel(const char* fname, unsigned width, unsigned height, unsigned band, filler &fill, sink &tee, int level = Z_DEFAULT_COMPRESSION) {
+      return write_band_frames_parallel<frame<>>(fname, width, height, band, fill, level, tee);
+   }
+
+   template<typename filler, typename emitter>
+   void deflate_bands(unsigned width, unsigned height, unsigned band, filler &fill, int level, unsigned y0, unsigned y1, emitter &emit) {
+      deflate_band_frames<frame<>>(width, height, band, fill, level, y0, y1, emit);
+   }
+
+   template<typename painter>
+   int write_painter(const char* fname, unsigned width, unsigned height, painter &p, unsigned band = 64) {
+      return write_painter_bands<frame<>>(fname, width, height, band, p);
+   }
+}
+
+#endif
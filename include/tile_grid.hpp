@@ -0,0 +1,157 @@
+#ifndef TILE_GRID_HPP
+#define TILE_GRID_HPP
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+
+// All 24 permutations of 4 and their inverses, in lexicographic order.
+struct perm_table {
+   size_t perms[24][4];
+   size_t inv[24][4];
+   // swapped[k][x][y]: rank of permutation k with entries x and y exchanged.
+   uint8_t swapped[24][4][4];
+
+   static size_t rank(const size_t (&p)[4]) {
+      size_t r = 0;
+      for (int i = 0; i < 4; i++) {
+         size_t smaller = 0;
+         for (int k = i+1; k < 4; k++)
+            if (p[k] < p[i])
+               smaller++;
+         r = r*(4-i) + smaller;
+      }
+      return r;
+   }
+
+   perm_table() {
+      size_t p[4] = {0, 1, 2, 3};
+      for (int k = 0; k < 24; k++) {
+         for (int d = 0; d < 4; d++) {
+            perms[k][d] = p[d];
+            inv[k][p[d]] = d;
+         }
+         std::next_permutation(p, p+4);
+      }
+      for (int k = 0; k < 24; k++)
+         for (int x = 0; x < 4; x++)
+            for (int y = 0; y < 4; y++) {
+               size_t q[4] = {perms[k][0], perms[k][1], perms[k][2], perms[k][3]};
+               std::swap(q[x], q[y]);
+               swapped[k][x][y] = rank(q);
+            }
+   }
+};
+
+struct row_major {
+   size_t n, m;
+
+   row_major(size_t n, size_t m) : n(n), m(m) { }
+
+   inline size_t size() const {
+      return n*m;
+   }
+
+   inline size_t operator()(size_t i, size_t j) const {
+      return i*m + j;
+   }
+};
+
+// Z-order layout, so that neighboring tiles are usually in the same cache
+// line in both directions. Each axis is padded to a power of two on its own;
+// the low bits of i and j are interleaved over the square part and the extra
+// high bits of the longer axis go on top, so a skinny grid needs less than
+// 4 n m entries rather than the square of its longer side.
+struct morton {
+   unsigned ni, nj, k;
+
+   static inline unsigned bits(size_t n) {
+      unsigned b = 0;
+      while ((size_t(1) << b) < n)
+         b++;
+      return b;
+   }
+
+   morton(size_t n, size_t m) : ni(bits(n)), nj(bits(m)), k(ni < nj ? ni : nj) { }
+
+   static inline uint64_t spread(uint64_t x) {
+      x &= 0xffffffff;
+      x = (x | (x << 16)) & 0x0000ffff0000ffff;
+      x = (x | (x << 8)) & 0x00ff00ff00ff00ff;
+      x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0f;
+      x = (x | (x << 2)) & 0x3333333333333333;
+      x = (x | (x << 1)) & 0x5555555555555555;
+      return x;
+   }
+
+   inline size_t size() const {
+      return size_t(1) << (ni + nj);
+   }
+
+   inline size_t operator()(size_t i, size_t j) const {
+      const size_t low = (size_t(1) << k) - 1;
+      const size_t high = ni > nj ? i >> k : j >> k;
+      return (high << (2*k)) | (spread(i & low) << 1) | spread(j & low);
+   }
+};
+
+// Grid of tiles packed in 16 bits each: the rank of the tile's permutation
+// (5 bits) followed by a 2-bit palette index for each of its 4 sides. The
+// packed value doubles as a dense key for the tile's appearance.
+template<typename layout = row_major>
+struct tile_grid {
+
+   static constexpr size_t keys = 1 << 13;
+
+   static inline const perm_table table;
+
+   const size_t n, m;
+   layout _layout;
+   std::vector<uint16_t> _tiles;
+
+   tile_grid(size_t n, size_t m) : n(n), m(m), _layout(n, m), _tiles(_layout.size(), 0) { }
+
+   static inline void decode(uint16_t key, size_t (&p)[4], size_t (&c)[4]) {
+      for (int d = 0; d < 4; d++) {
+         p[d] = table.perms[key & 31][d];
+         c[d] = (key >> (5 + 2*d)) & 3;
+      }
+   }
+
+   inline uint16_t key(size_t i, size_t j) const {
+      return _tiles[_layout(i, j)];
+   }
+
+   inline size_t perm(size_t i, size_t j) const {
+      return key(i, j) & 31;
+   }
+
+   inline size_t side(size_t i, size_t j, size_t d) const {
+      return table.perms[perm(i, j)][d];
+   }
+
+   inline size_t inv(size_t i, size_t j, size_t d) const {
+      return table.inv[perm(i, j)][d];
+   }
+
+   inline size_t color(size_t i, size_t j, size_t d) const {
+      return (key(i, j) >> (5 + 2*d)) & 3;
+   }
+
+   inline void set_perm(size_t i, size_t j, size_t k) {
+      uint16_t &t = _tiles[_layout(i, j)];
+      t = (t & ~31) | k;
+   }
+
+   inline void set_color(size_t i, size_t j, size_t d, size_t c) {
+      uint16_t &t = _tiles[_layout(i, j)];
+      t = (t & ~(3 << (5 + 2*d))) | (c << (5 + 2*d));
+   }
+
+   inline void swap_sides(size_t i, size_t j, size_t x, size_t y) {
+      set_perm(i, j, table.swapped[perm(i, j)][x][y]);
+   }
+};
+
+#endif
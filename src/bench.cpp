@@ -0,0 +1,66 @@
+#include <iostream>
+#include <cstring>
+
+#include <frame.hpp>
+#include <pages.hpp>
+#include <timer.hpp>
+
+#include <stdlib.h>
+#include <omp.h>
+
+// Memory bandwidth of frame::paint by thread count, for a frame first
+// touched by a single thread on the default heap and for one from
+// huge_page_resource, first touched in parallel. The huge page frame is
+// touched in the partition of the full thread count, so only that last row
+// matches its placement. The cross-socket effect this is meant to show, the
+// heap frame ceasing to scale once threads of other sockets join, has not
+// been measured on a multi-socket machine.
+
+struct solid_painter {
+   im::pixel c;
+
+   inline im::pixel paint(size_t x, size_t y) {
+      return c;
+   }
+};
+
+template<typename frame>
+double paint_rate(frame &f, int threads, int reps) {
+   omp_set_num_threads(threads);
+   solid_painter p{{1, 2, 3}};
+   f.paint(p);
+   timer t;
+   for (int r = 0; r < reps; r++) {
+      p.c.r = r;
+      f.paint(p);
+   }
+   double bytes = double(f.get_width())*f.get_height()*sizeof(im::pixel)*reps;
+   return bytes / t.get_time() / 1e9;
+}
+
+// bench [width height reps]
+int main(int argc, char** argv) {
+   size_t w = argc > 1 ? strtoull(argv[1], NULL, 10) : 16384;
+   size_t h = argc > 2 ? strtoull(argv[2], NULL, 10) : 16384;
+   int reps = argc > 3 ? atoi(argv[3]) : 5;
+   const int max_threads = omp_get_max_threads();
+
+   std::cout << w << "x" << h << " frame, " << max_threads << " threads, GB/s written" << std::endl;
+   std::cout << "(NUMA placement is only visible on multi-socket machines; one socket shows no difference)" << std::endl;
+   std::cout << "threads\theap+serial touch\thuge pages+parallel touch" << std::endl;
+
+   im::frame<> heap(w, h);
+   std::memset(heap._pixels, 0, w*h*sizeof(im::pixel));
+
+   im::huge_page_resource pages;
+   im::frame<> huge(w, h, &pages);
+
+   for (int t = 1; ; t = 2*t < max_threads ? 2*t : max_threads) {
+      double a = paint_rate(heap, t, reps);
+      double b = paint_rate(huge, t, reps);
+      std::cout << t << "\t" << a << "\t" << b << std::endl;
+      if (t == max_threads)
+         break;
+   }
+   return 0;
+}
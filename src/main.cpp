@@ -1,67 +1,27 @@
 #include <iostream>
+#include <algorithm>
 #include <cmath>
+#include <string>
 
+#include <atlas.hpp>
+#include <canvas.hpp>
+#include <composite.hpp>
+#include <downsample.hpp>
 #include <image.hpp>
+#include <indexed.hpp>
+#include <pattern.hpp>
+#include <pyramid.hpp>
+#include <raster.hpp>
+#include <shard.hpp>
+#include <rng.hpp>
+#include <stream.hpp>
+#include <tile_grid.hpp>
 
 #include <stdint.h>
 
-/* This is xoshiro256++ 1.0, one of our all-purpose, rock-solid generators.
-   It has excellent (sub-ns) speed, a state (256 bits) that is large
-   enough for any parallel application, and it passes all tests we are
-   aware of.
-
-   For generating just floating-point numbers, xoshiro256+ is even faster.
-
-   The state must be seeded so that it is not everywhere zero. If you have
-   a 64-bit seed, we suggest to seed a splitmix64 generator and use its
-   output to fill s. */
-
-static inline uint64_t rotl(const uint64_t x, int k) {
-	return (x << k) | (x >> (64 - k));
-}
-
-
-static uint64_t s[4] = {684684,6546843,219681,468984};
-
-uint64_t next(void) {
-	const uint64_t result = rotl(s[0] + s[3], 23) + s[0];
-
-	const uint64_t t = s[1] << 17;
-
-	s[2] ^= s[0];
-	s[3] ^= s[1];
-	s[1] ^= s[2];
-	s[0] ^= s[3];
-
-	s[2] ^= t;
-
-	s[3] = rotl(s[3], 45);
-
-	return result;
-}
-
-template <size_t N, size_t ITERS=8>
-void next_perm(size_t (&p)[N]) {
-   for (int i=0; i<N; i++)
-      p[i] = i;
-   for (int iter=0; iter<ITERS; iter++) {
-      size_t a, b;
-      a = next() % N;
-      do {
-         b = next() % N;
-      } while (b == a);
-      std::swap(p[a], p[b]);
-   }
-}
-
-template <size_t D, size_t N>
-void next_color(const im::pixel (&colors)[D], im::pixel (&c)[N]) {
-   for (int i=0; i<N; i++)
-      c[i] = colors[next() % D];
-}
-
-template<size_t w, size_t l, size_t t=3>
 struct bg_painter {
+   size_t w, l, t;
+
    im::pixel paint(size_t x, size_t y) {
       if (x < t or y < t or x >= (w-t) or y >= (l-t))
          return {64, 64, 64};
@@ -69,14 +29,15 @@ struct bg_painter {
    }
 };
 
-template <size_t lw, size_t sep, size_t sl, size_t bw=3>
-im::image<2*lw + 3*sep, 2*lw + 3*sep> piece(size_t (&p)[4], im::pixel (&c)[4]) {
-   static const int n = 2*lw + 3*sep;
-   static auto bg = bg_painter<n, n, bw>();
+// Renders the piece for permutation p and side colors c into pi, which must
+// be 2*lw + 3*sep pixels square.
+template <typename image>
+void paint_piece(image &pi, int lw, int sep, int sl, int bw, const size_t (&p)[4], const im::pixel (&c)[4]) {
+   const int n = 2*lw + 3*sep;
+   bg_painter bg{size_t(n), size_t(n), size_t(bw)};
    size_t p_inv[4];
    for (int d=0; d<4; d++)
       p_inv[p[d]] = d;
-   im::image<n, n> pi;
    pi.paint_frame(bg);
    int tmp;
    int dx = 1;
@@ -87,11 +48,7 @@ im::image<2*lw + 3*sep, 2*lw + 3*sep> piece(size_t (&p)[4], im::pixel (&c)[4]) {
    int tsl = sl;
    for (int d=0; d<4; d++) {
 
-      for (int x=0; x<tlw; x++) {
-         for (int y=0; y<tsl; y++) {
-            pi._image._pixel_rows[iy + y*dy][ix + x*dx] = c[d];
-         }
-      }
+      im::fill(pi, im::rect(ix, iy, dx, dy, tlw, tsl), c[d]);
 
       tmp = dy;
       dy = dx;
@@ -108,25 +65,13 @@ im::image<2*lw + 3*sep, 2*lw + 3*sep> piece(size_t (&p)[4], im::pixel (&c)[4]) {
    int bx = lw;
    int by = 0;
    for (int d=0; d<4; d++) {
-      for (int i=1; i<bx; i++) {
-         for (int j=0; j<i; j++) {
-            pi._image._pixel_rows[iy + i*dy][ix - (j+1)*dx] = c[p_inv[d]];
-            pi._image._pixel_rows[iy + i*dy][ix + (lw + j)*dx] = c[p_inv[d]];
-         }
-      }
-      for (int i=1; i<by; i++) {
-         for (int j=0; j<i; j++) {
-            pi._image._pixel_rows[iy - (j+1)*dy][ix + i*dx] = c[p_inv[d]];
-            pi._image._pixel_rows[iy + (lw + j)*dy][ix + i*dx] = c[p_inv[d]];
-         }
-      }
+      im::fill(pi, im::stair(ix, iy, dx, dy, 1, 1, bx-1, -1, -1, -1, 0), c[p_inv[d]]);
+      im::fill(pi, im::stair(ix, iy, dx, dy, 1, 1, bx-1, lw, 0, lw, 1), c[p_inv[d]]);
+      im::fill(pi, im::stair(ix, iy, dx, dy, -1, -1, by-1, 1, 1, by-1, 0), c[p_inv[d]]);
+      im::fill(pi, im::stair(ix, iy, dx, dy, lw, 1, by-1, 1, 1, by-1, 0), c[p_inv[d]]);
       std::swap(bx, by);
 
-      for (int x=0; x<tlw; x++) {
-         for (int y=0; y<tsl; y++) {
-            pi._image._pixel_rows[iy + y*dy][ix + x*dx] = c[p_inv[d]];
-         }
-      }
+      im::fill(pi, im::rect(ix, iy, dx, dy, tlw, tsl), c[p_inv[d]]);
 
       tmp = dy;
       dy = dx;
@@ -193,13 +138,7 @@ im::image<2*lw + 3*sep, 2*lw + 3*sep> piece(size_t (&p)[4], im::pixel (&c)[4]) {
          }
          steps += 2*(lw-w);
       }
-      for (int i=0; i<steps+1; i++) {
-         for (int x=0; x<w; x++) {
-            for (int y=0; y<w; y++) {
-               pi._image._pixel_rows[iy + i*sy + y*dy][ix + i*sx + x*dx] = c[d];
-            }
-         }
-      }
+      im::fill(pi, im::sweep(ix, iy, dx, dy, w, sx, sy, steps), c[d]);
       if (sx != 0 and sy !=0) {
          if (d % 2 == 0) {
             iy += dy*(lw-w);
@@ -220,6 +159,25 @@ im::image<2*lw + 3*sep, 2*lw + 3*sep> piece(size_t (&p)[4], im::pixel (&c)[4]) {
       iy = ix;
       ix = n - 1 - tmp;
    }
+}
+
+template <size_t lw, size_t sep, size_t sl, size_t bw=3>
+void paint_piece(im::image<2*lw + 3*sep, 2*lw + 3*sep> &pi, const size_t (&p)[4], const im::pixel (&c)[4]) {
+   paint_piece(pi, lw, sep, sl, bw, p, c);
+}
+
+template <size_t lw, size_t sep, size_t sl, size_t bw=3>
+im::image<2*lw + 3*sep, 2*lw + 3*sep> piece(const size_t (&p)[4], const im::pixel (&c)[4]) {
+   static const int n = 2*lw + 3*sep;
+   im::image<n, n> pi;
+   paint_piece<lw, sep, sl, bw>(pi, p, c);
+   return pi;
+}
+
+im::image<> piece(int lw, int sep, int sl, int bw, const size_t (&p)[4], const im::pixel (&c)[4]) {
+   const int n = 2*lw + 3*sep;
+   im::image<> pi(n, n);
+   paint_piece(pi, lw, sep, sl, bw, p, c);
    return pi;
 }
 
@@ -243,7 +201,7 @@ void rand_main() {
    const size_t w = n*ps;
    const size_t h = m*ps;
 
-   im::image<w, h> pattern;
+   im::indexed_image<w, h, 2> pattern({{64, 64, 64}, {255, 255, 255}, {0, 0, 0}});
 
    size_t pieces[n][m][4];
    im::pixel colors[n][m][4];
@@ -280,12 +238,10 @@ void rand_main() {
          }
       }
    }
-   for (int i=0; i<n; i++) {
-      for (int j=0; j<m; j++) {
-         auto pattern_piece = piece<lw, sep, sl>(pieces[i][j], colors[i][j]);
-         pattern._image.view(i*ps, j*ps, ps, ps).paint(pattern_piece);
-      }
-   }
+   auto render = [&](size_t i, size_t j, im::image<ps, ps> &tile) {
+      paint_piece<lw, sep, sl>(tile, pieces[i][j], colors[i][j]);
+   };
+   im::composite<im::image<ps, ps>>(pattern, n, m, ps, ps, render);
 
    pattern.write("rand_pattern_bw.png");
 }
@@ -300,34 +256,52 @@ void path_main() {
    const size_t w = n*ps;
    const size_t h = m*ps;
 
-   im::image<w, h> pattern;
+   size_t p[4] = {0, 1, 2, 3};
+   im::pixel c[4] = {{0,0,0}, {0,0,0}, {0,0,0}, {0,0,0}};
+   im::pixel bc[4] = {{0,0,0}, {0,0,0}, {0,0,0}, {0,0,0}};
+
+   // Tiles are keyed by the rank of their permutation; the side colors are
+   // always bc.
+   const perm_table table;
+   im::atlas<ps, ps> tiles(24);
+   auto render = [&](size_t key, im::image<ps, ps> &tile) {
+      paint_piece<lw, sep, sl>(tile, table.perms[key], bc);
+   };
+   auto draw = [&](size_t key, auto &view) {
+      view.blit(tiles.get(key, render));
+   };
+
+   // Stills only re-deflate the tile rows placed since the previous one, and
+   // keep their 2-bit palette.
+   im::canvas<w, h> pattern(ps, ps);
+   const std::vector<im::pixel> palette = {{64, 64, 64}, {255, 255, 255}, {0, 0, 0}};
+   auto write_still = [&](const char* fname) {
+      pattern.write(fname, palette);
+   };
+   auto place = [&](size_t i, size_t j) {
+      pattern.set(i, j, perm_table::rank(p), draw);
+   };
    size_t a = 8;
    size_t b = 7;
    size_t i = 0;
 
-   size_t p[4] = {0, 1, 2, 3};
-   im::pixel c[4] = {{0,0,0}, {0,0,0}, {0,0,0}, {0,0,0}};
-   im::pixel bc[4] = {{0,0,0}, {0,0,0}, {0,0,0}, {0,0,0}};
    for (int i=0; i<n; i++) {
       for (int j=0; j<m; j++) {
-         auto pattern_piece = piece<lw, sep, sl>(p, bc);
-         pattern._image.view(i*ps, j*ps, ps, ps).paint(pattern_piece);
+         place(i, j);
       }
    }
-   pattern.write("loop_0_bw.png");
+   write_still("loop_0_bw.png");
 
    c[0] = {255, 0, 0};
-   auto pattern_piece = piece<lw, sep, sl>(p, bc);
-   pattern._image.view(a*ps, b*ps, ps, ps).paint(pattern_piece);
+   place(a, b);
    c[0] = {0, 0, 0};
    b -= 1;
 
 
    c[2] = {255, 0, 0};
-   pattern_piece = piece<lw, sep, sl>(p, bc);
-   pattern._image.view(a*ps, b*ps, ps, ps).paint(pattern_piece);
+   place(a, b);
    c[2] = {0, 0, 0};
-   pattern.write("loop_1_bw.png");
+   write_still("loop_1_bw.png");
 
    for (int i=0; i<4; i++) {
       p[0] = 0;
@@ -338,8 +312,7 @@ void path_main() {
       c[1] = {0, 0, 0};
       c[2] = {0, 255, 0};
       c[3] = {0, 0, 255};
-      pattern_piece = piece<lw, sep, sl>(p, bc);
-      pattern._image.view(a*ps, b*ps, ps, ps).paint(pattern_piece);
+      place(a, b);
 
       a -= 1;
       p[0] = 0;
@@ -350,8 +323,7 @@ void path_main() {
       c[1] = {0, 0, 255};
       c[2] = {0, 0, 0};
       c[3] = {0, 255, 0};
-      pattern_piece = piece<lw, sep, sl>(p, bc);
-      pattern._image.view(a*ps, b*ps, ps, ps).paint(pattern_piece);
+      place(a, b);
 
       a -= 1;
       p[0] = 1;
@@ -362,8 +334,7 @@ void path_main() {
       c[1] = {255, 0, 0};
       c[2] = {0, 0, 0};
       c[3] = {0, 0, 0};
-      pattern_piece = piece<lw, sep, sl>(p, bc);
-      pattern._image.view(a*ps, b*ps, ps, ps).paint(pattern_piece);
+      place(a, b);
       b -= 1;
    }
 
@@ -376,10 +347,9 @@ void path_main() {
    c[1] = {255, 0, 0};
    c[2] = {0, 0, 0};
    c[3] = {0, 0, 0};
-   pattern_piece = piece<lw, sep, sl>(p, bc);
-   pattern._image.view(a*ps, b*ps, ps, ps).paint(pattern_piece);
+   place(a, b);
 
-   pattern.write("loop_5_bw.png");
+   write_still("loop_5_bw.png");
 
 }
 
@@ -397,157 +367,315 @@ im::pixel rot_color(im::pixel color) {
     return ret;
 }
 
-int sft_main() {
-   const size_t lw = 6;
-   const size_t sep = 18;
-   const size_t sl = 8;
-   const size_t bw = 0;
+// Permutations a tile may take given its already placed top and left
+// neighbors. A tile mapping its top side to itself (p[0] == 0) needs
+// top_self, one mapping it to the left side (p[0] == 3) needs top_left, and
+// likewise p[3] == 3 needs left_self and p[3] == 0 needs left_top.
+struct constraint_table {
+   static const size_t any = 15;
+
+   size_t valid[16][24];
+   size_t count[16];
+
+   static size_t state(bool top_self, bool top_left, bool left_self, bool left_top) {
+      return top_self | (top_left << 1) | (left_self << 2) | (left_top << 3);
+   }
+
+   constraint_table(const perm_table &perms) {
+      for (size_t s=0; s<16; s++) {
+         count[s] = 0;
+         for (size_t k=0; k<24; k++) {
+            size_t top = perms.perms[k][0];
+            size_t left = perms.perms[k][3];
+            bool ok = (top == 0 ? s & 1 : top == 3 ? s & 2 : true) and (left == 3 ? s & 4 : left == 0 ? s & 8 : true);
+            if (ok)
+               valid[s][count[s]++] = k;
+         }
+      }
+   }
+};
+
+struct sft_params {
+   size_t lw = 6;
+   size_t sep = 18;
+   size_t sl = 8;
+   size_t bw = 0;
+   size_t n = 300;
+   size_t m = 300;
+   uint64_t seed = 684684;
+   // Tiles are rendered ss times larger and box filtered down, which smooths
+   // the diagonal connectors. ss must be a power of two; 1 turns this off.
+   size_t ss = 1;
+   const char* fname = "rand-sft.png";
+   // With shard_fname set, only tile rows [shard*m/shards, (shard+1)*m/shards)
+   // are rendered, into a shard file for im::stitch instead of a PNG.
+   size_t shard = 0;
+   size_t shards = 1;
+   const char* shard_fname = NULL;
+   // With dzi set, a Deep Zoom pyramid dzi.dzi is written instead of fname.
+   const char* dzi = NULL;
+   // A thumbnail reduced thumb times is written alongside fname, unless
+   // thumb_fname is NULL.
+   unsigned thumb = 8;
+   const char* thumb_fname = "rand-sft-thumb.png";
+};
+
+// Returns why params cannot be rendered, or NULL if they can.
+const char* sft_params_error(const sft_params &params) {
+   if (params.lw == 0 or params.sep == 0)
+      return "lw and sep must be positive";
+   if (params.sl == 0 or params.sl > params.sep)
+      return "sl must be between 1 and sep";
+   const size_t ps = 3*params.sep + 2*params.lw;
+   if (2*params.bw >= ps)
+      return "bw must be less than half the tile size";
+   if (params.n == 0 or params.m == 0)
+      return "n and m must be positive";
+   if (params.n > 0x7fffffff / ps or params.m > 0x7fffffff / ps)
+      return "the image is too large for PNG";
+   if (params.ss == 0 or (params.ss & (params.ss - 1)))
+      return "ss must be a power of two";
+   if (params.ss > 1 and params.ss > (1 << 16) / ps)
+      return "ss times the tile size must not exceed 65536";
+   if (params.shards == 0 or params.shard >= params.shards)
+      return "shard k of K needs k < K";
+   return NULL;
+}
+
+int sft_main(const sft_params &params) {
+   if (sft_params_error(params))
+      return 1;
+   const size_t lw = params.lw;
+   const size_t sep = params.sep;
+   const size_t sl = params.sl;
+   const size_t bw = params.bw;
    const size_t ps = 3*sep + 2*lw;
-   const size_t n = 300;
-   const size_t m = 300;
+   const size_t n = params.n;
+   const size_t m = params.m;
    const size_t w = n*ps;
    const size_t h = m*ps;
 
-   im::image<w, h> pattern;
+   const uint64_t seed = params.seed;
 
    const size_t D = 3;
+   static_assert(D <= 4, "tile_grid stores 2-bit color indices");
    im::pixel colors[D] = {{255, 0, 0}, {0, 255, 0}, {0, 0, 255}};
-
-   size_t pieces[n][m][4];
-   size_t inv_pieces[n][m][4];
-   im::pixel pcolors[n][m][4];
-   
-   next_perm<4>(pieces[0][0]);
-   inv_perm<4>(pieces[0][0], inv_pieces[0][0]);
-   next_color<D, 4>(colors, pcolors[0][0]);
-   //auto pattern_piece = piece<lw, sep, sl>(pieces[0][0], pcolors[0][0]);
-   //pattern._image.view(0, 0, ps, ps).paint(pattern_piece);
-
-   // top row
-   for (int i=1; i<n; i++) {
-      do {
-         next_perm<4>(pieces[i][0]);
-         inv_perm<4>(pieces[i][0], inv_pieces[i][0]);
-      } while (pieces[i][0][3] == 3 and pieces[i-1][0][1] != 1 and pcolors[i-1][0][1] != rot_color(rot_color(pcolors[i-1][0][inv_pieces[i-1][0][1]])));
-      next_color<D, 4>(colors, pcolors[i][0]);
-      pcolors[i][0][3] = rot_color(pcolors[i-1][0][inv_pieces[i-1][0][1]]);
-      pcolors[i][0][inv_pieces[i][0][3]] = rot_color(rot_color(pcolors[i-1][0][1]));
-
-      //auto pattern_piece = piece<lw, sep, sl>(pieces[i][0], pcolors[i][0]);
-      //pattern._image.view(i*ps, 0, ps, ps).paint(pattern_piece);
+   // rot[k]: palette index of rot_color(colors[k]), rot2[k] = rot[rot[k]]
+   size_t rot[D];
+   size_t rot2[D];
+   for (int k=0; k<D; k++) {
+      rot[k] = 0;
+      while (rot[k] < D-1 and colors[rot[k]] != rot_color(colors[k]))
+         rot[k]++;
    }
-
-   // left col
-   for (int j=1; j<m; j++) {
-      do {
-         next_perm<4>(pieces[0][j]);
-         inv_perm<4>(pieces[0][j], inv_pieces[0][j]);
-      } while (pieces[0][j][0] == 0 and pieces[0][j-1][2] != 2 and pcolors[0][j-1][2] != rot_color(rot_color(pcolors[0][j-1][inv_pieces[0][j-1][2]])));
-      next_color<D, 4>(colors, pcolors[0][j]);
-      pcolors[0][j][0] = rot_color(pcolors[0][j-1][inv_pieces[0][j-1][2]]);
-      pcolors[0][j][inv_pieces[0][j][0]] = rot_color(rot_color(pcolors[0][j-1][2]));
-
-      //auto pattern_piece = piece<lw, sep, sl>(pieces[0][j], pcolors[0][j]);
-      //pattern._image.view(0, j*ps, ps, ps).paint(pattern_piece);
-   }
-
-   // rest
-   for (int i=1; i<n; i++) {
-      for (int j=1; j<m; j++) {
-         do {
-            next_perm<4>(pieces[i][j]);
-            inv_perm<4>(pieces[i][j], inv_pieces[i][j]);
-         } while (not(
-            (
-                (pieces[i][j][0] != 0 and pieces[i][j][0] != 3) or
-                (pieces[i][j][0] == 0 and pieces[i][j-1][2] == 2) or
-                (pieces[i][j][0] == 0 and pcolors[i][j-1][2] == rot_color(rot_color(pcolors[i][j-1][inv_pieces[i][j-1][2]]))) or
-                (pieces[i][j][0] == 3 and pcolors[i-1][j][1] == rot_color(rot_color(pcolors[i][j-1][inv_pieces[i][j-1][2]])))
-            )
-            and
-            (
-                (pieces[i][j][3] != 0 and pieces[i][j][3] != 3) or
-                (pieces[i][j][3] == 3 and pieces[i-1][j][1] == 1) or
-                (pieces[i][j][3] == 3 and pcolors[i-1][j][1] == rot_color(rot_color(pcolors[i-1][j][inv_pieces[i-1][j][1]]))) or
-                (pieces[i][j][3] == 0 and pcolors[i][j-1][2] == rot_color(rot_color(pcolors[i-1][j][inv_pieces[i-1][j][1]])))
-            )
-         ));
-         next_color<D, 4>(colors, pcolors[i][j]);
-         pcolors[i][j][0] = rot_color(pcolors[i][j-1][inv_pieces[i][j-1][2]]);
-         pcolors[i][j][inv_pieces[i][j][0]] = rot_color(rot_color(pcolors[i][j-1][2]));
-         pcolors[i][j][3] = rot_color(pcolors[i-1][j][inv_pieces[i-1][j][1]]);
-         pcolors[i][j][inv_pieces[i][j][3]] = rot_color(rot_color(pcolors[i-1][j][1]));
-
-         //auto pattern_piece = piece<lw, sep, sl>(pieces[i][j], pcolors[i][j]);
-         //pattern._image.view(i*ps, j*ps, ps, ps).paint(pattern_piece);
-         //pattern.write("test.png");
+   for (int k=0; k<D; k++)
+      rot2[k] = rot[rot[k]];
+
+   tile_grid<> grid(n, m);
+
+   static const constraint_table constraints(grid.table);
+
+   // Tile (i, j) only reads its top (i, j-1) and left (i-1, j) neighbors and
+   // draws from its own counter_rng stream.
+   auto generate = [&](int i, int j) {
+      counter_rng g(seed, i, j);
+      bool top_self = true;
+      bool top_left = true;
+      bool left_self = true;
+      bool left_top = true;
+      if (j > 0)
+         top_self = grid.side(i, j-1, 2) == 2 or grid.color(i, j-1, 2) == rot2[grid.color(i, j-1, grid.inv(i, j-1, 2))];
+      if (i > 0)
+         left_self = grid.side(i-1, j, 1) == 1 or grid.color(i-1, j, 1) == rot2[grid.color(i-1, j, grid.inv(i-1, j, 1))];
+      if (i > 0 and j > 0) {
+         top_left = grid.color(i-1, j, 1) == rot2[grid.color(i, j-1, grid.inv(i, j-1, 2))];
+         left_top = grid.color(i, j-1, 2) == rot2[grid.color(i-1, j, grid.inv(i-1, j, 1))];
       }
-   }
-
-   /*
-   for (int i=0; i<n; i++) {
-      for (int j=0; j<m; j++) {
-         auto pattern_piece = piece<lw, sep, sl, bw>(pieces[i][j], pcolors[i][j]);
-         pattern._image.view(i*ps, j*ps, ps, ps).paint(pattern_piece);
+      size_t state = constraint_table::state(top_self, top_left, left_self, left_top);
+      grid.set_perm(i, j, constraints.valid[state][g.bounded(constraints.count[state])]);
+      for (int d=0; d<4; d++)
+         grid.set_color(i, j, d, g.bounded(D));
+      if (j > 0) {
+         grid.set_color(i, j, 0, rot[grid.color(i, j-1, grid.inv(i, j-1, 2))]);
+         grid.set_color(i, j, grid.inv(i, j, 0), rot2[grid.color(i, j-1, 2)]);
+      }
+      if (i > 0) {
+         grid.set_color(i, j, 3, rot[grid.color(i-1, j, grid.inv(i-1, j, 1))]);
+         grid.set_color(i, j, grid.inv(i, j, 3), rot2[grid.color(i-1, j, 1)]);
       }
+   };
+
+   // Tiles on an anti-diagonal are independent of each other.
+   for (int d=0; d<n+m-1; d++) {
+      int i0 = d < m ? 0 : d-m+1;
+      int i1 = d < n ? d : n-1;
+      #pragma omp parallel for schedule(static)
+      for (int i=i0; i<=i1; i++)
+         generate(i, d-i);
    }
-   pattern.write("test.png");
-   */
 
-   // Shuffling
+   // Shuffling. A tile only reads its 4 neighbors, which all have the other
+   // checkerboard color, so each color is shuffled in parallel. Draws are
+   // keyed by (sweep, i, j), so the result does not depend on thread count.
    const int pn = 3;
    const int pd = 5;
-   for (int i=0; i<n; i++) {
-      for (int j=0; j<m; j++) {
-         for (int x=0; x<3; x++) {
-            for (int y=x+1; y<4; y++) {
-               if (pcolors[i][j][x] == pcolors[i][j][y]) {
-                  if (pieces[i][j][x] == x) {
-                     int dx = -1 + 2*(x/2);
-                     int xop = (x + 2) % 4;
-                     if (x%2==0 and (0 <= j+dx) and (j+dx < m) and pieces[i][j+dx][xop] == xop)
-                        goto nextx;
-                     if (x%2==1 and (0 <= i-dx) and (i-dx < n) and pieces[i-dx][j][xop] == xop)
-                        goto nextx;
-                  }
-                  if (pieces[i][j][y] == y) {
-                     int dy = -1 + 2*(y/2);
-                     int yop = (y + 2) % 4;
-                     if (y%2==0 and (0 <= j+dy) and (j+dy < m) and pieces[i][j+dy][yop] == yop)
-                        continue;
-                     if (y%2==1 and (0 <= i-dy) and (i-dy < n) and pieces[i-dy][j][yop] == yop)
-                        continue;
-                  }
+   const int sweeps = 1;
+   auto shuffle = [&](int i, int j, counter_rng &g) {
+      for (int x=0; x<3; x++) {
+         for (int y=x+1; y<4; y++) {
+            if (grid.color(i, j, x) == grid.color(i, j, y)) {
+               if (grid.side(i, j, x) == x) {
+                  int dx = -1 + 2*(x/2);
+                  int xop = (x + 2) % 4;
+                  if (x%2==0 and (0 <= j+dx) and (j+dx < m) and grid.side(i, j+dx, xop) == xop)
+                     goto nextx;
+                  if (x%2==1 and (0 <= i-dx) and (i-dx < n) and grid.side(i-dx, j, xop) == xop)
+                     goto nextx;
+               }
+               if (grid.side(i, j, y) == y) {
+                  int dy = -1 + 2*(y/2);
+                  int yop = (y + 2) % 4;
+                  if (y%2==0 and (0 <= j+dy) and (j+dy < m) and grid.side(i, j+dy, yop) == yop)
+                     continue;
+                  if (y%2==1 and (0 <= i-dy) and (i-dy < n) and grid.side(i-dy, j, yop) == yop)
+                     continue;
+               }
  
-                  if ((next() % pd) < pn) {
-                     std::swap(pieces[i][j][x], pieces[i][j][y]);
-                     //goto nextpiece;
-                  }
+               if (g.bounded(pd) < pn) {
+                  grid.swap_sides(i, j, x, y);
+                  //return;
                }
             }
-            nextx:;
          }
-         nextpiece:;
+         nextx:;
+      }
+   };
+   for (int sweep=0; sweep<sweeps; sweep++) {
+      for (int color=0; color<2; color++) {
+         #pragma omp parallel for schedule(static)
+         for (int i=0; i<n; i++) {
+            for (int j=(i+color)%2; j<m; j+=2) {
+               counter_rng g(mix64(seed + 1 + sweep), i, j);
+               shuffle(i, j, g);
+            }
+         }
       }
    }
 
+   im::atlas<> tiles(grid.keys, ps, ps);
+   const size_t ss = params.ss;
+   auto render = [&](size_t key, im::image<> &tile) {
+      size_t p[4];
+      size_t ci[4];
+      im::pixel c[4];
+      grid.decode(key, p, ci);
+      for (int d=0; d<4; d++)
+         c[d] = colors[ci[d]];
+      if (ss == 1) {
+         paint_piece(tile, lw, sep, sl, bw, p, c);
+         return;
+      }
+      // Only the distinct tiles are supersampled, so the cost does not grow
+      // with the canvas.
+      im::image<> large(ss*ps, ss*ps, im::scratch_resource());
+      paint_piece(large, ss*lw, ss*sep, ss*sl, ss*bw, p, c);
+      im::downsample(large, tile, unsigned(ss));
+   };
+   // Every process regenerates the whole grid, which is cheap and identical
+   // for a given seed, but only renders its own tile rows.
+   const size_t j0 = params.shard*m / params.shards;
+   const size_t j1 = (params.shard + 1)*m / params.shards;
+
+   // A shard also reads the tile row above its own, which its first band is
+   // filtered against.
+   std::vector<size_t> keys;
+   std::vector<bool> used(grid.keys, false);
    for (int i=0; i<n; i++) {
-      for (int j=0; j<m; j++) {
-         auto pattern_piece = piece<lw, sep, sl, bw>(pieces[i][j], pcolors[i][j]);
-         pattern._image.view(i*ps, j*ps, ps, ps).paint(pattern_piece);
+      for (int j=(j0 ? j0-1 : 0); j<j1; j++) {
+         if (!used[grid.key(i, j)]) {
+            used[grid.key(i, j)] = true;
+            keys.push_back(grid.key(i, j));
+         }
       }
    }
+   tiles.render(keys, render);
+
+   im::pattern_painter pattern(grid, tiles, w, h);
+   auto fill = [&](unsigned y, unsigned rows, im::frame<> &band) {
+      for (int j=0; j<rows; j++)
+         pattern.span(0, y + j, w, band.row(j));
+   };
+   if (params.dzi)
+      return im::write_bands_dzi(params.dzi, w, h, ps, fill);
+   if (!params.shard_fname and !params.thumb_fname)
+      return im::write_bands_parallel(params.fname, w, h, ps, fill);
+   if (!params.shard_fname) {
+      im::box_thumbnail thumb(w, h, params.thumb);
+      int err = im::write_bands_parallel(params.fname, w, h, ps, fill, thumb);
+      if (err)
+         return err;
+      return im::write_painter(params.thumb_fname, thumb.out.get_width(), thumb.out.get_height(), thumb.out);
+   }
 
-   pattern.write("rand-sft.png");
-
-   return 0;
+   im::shard_writer out;
+   int err = out.open(params.shard_fname, w, h, j0*ps, j1*ps);
+   if (err)
+      return err;
+   auto emit = [&](const im::zband &z) {
+      out.write(z);
+   };
+   im::deflate_bands(w, h, ps, fill, Z_DEFAULT_COMPRESSION, j0*ps, j1*ps, emit);
+   return out.close();
 }
 
-int main() {
+// main [lw sep sl bw n m seed ss]
+// main shard k K file [lw sep sl bw n m seed ss]
+//    renders shard k of K, a run of tile rows, into file
+// main stitch out.png file...
+//    joins shard files, in order, into out.png without recompressing
+// main dzi name [lw sep sl bw n m seed ss]
+//    writes the pattern as the Deep Zoom pyramid name.dzi
+int main(int argc, char** argv) {
 
    //piece_main();
    //rand_main();
    //path_main();
-   sft_main();
-}
+   if (argc > 1 and std::string(argv[1]) == "stitch") {
+      if (argc < 3)
+         return 1;
+      std::vector<std::string> shards(argv + 3, argv + argc);
+      int err = im::stitch(argv[2], shards);
+      if (err)
+         std::cerr << "stitch failed: " << err << std::endl;
+      return err;
+   }
 
+   sft_params params;
+   int a0 = 1;
+   if (argc > 4 and std::string(argv[1]) == "shard") {
+      params.shard = strtoull(argv[2], NULL, 10);
+      params.shards = strtoull(argv[3], NULL, 10);
+      params.shard_fname = argv[4];
+      a0 = 5;
+   }
+   else if (argc > 2 and std::string(argv[1]) == "dzi") {
+      params.dzi = argv[2];
+      a0 = 3;
+   }
+   size_t* fields[] = {&params.lw, &params.sep, &params.sl, &params.bw, &params.n, &params.m, NULL, &params.ss};
+   for (int a=a0; a<argc and a<a0+8; a++) {
+      if (fields[a-a0])
+         *fields[a-a0] = strtoull(argv[a], NULL, 10);
+      else
+         params.seed = strtoull(argv[a], NULL, 10);
+   }
+   if (const char* error = sft_params_error(params)) {
+      std::cerr << error << std::endl;
+      std::cerr << "usage: main [lw sep sl bw n m seed ss]" << std::endl;
+      std::cerr << "       main shard k K file [lw sep sl bw n m seed ss]" << std::endl;
+      std::cerr << "       main stitch out.png file..." << std::endl;
+      std::cerr << "       main dzi name [lw sep sl bw n m seed ss]" << std::endl;
+      return 1;
+   }
+   return sft_main(params);
+}